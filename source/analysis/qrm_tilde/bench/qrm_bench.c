@@ -0,0 +1,523 @@
+/*
+Copyright (c) 2022.  The Regents of the University of California (Regents).
+All Rights Reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for educational, research, and not-for-profit purposes, without
+fee and without a signed licensing agreement, is hereby granted, provided that
+the above copyright notice, this paragraph and the following two paragraphs
+appear in all copies, modifications, and distributions.  Contact The Office of
+Technology Licensing, UC Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley,
+CA 94720-1620, (510) 643-7201, for commercial licensing opportunities.
+
+Written by Jeremy L. Wagner, The Center for New Music and Audio Technologies,
+University of California, Berkeley.
+
+     IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+     SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+     ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF
+     REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+     REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+     LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+     FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+     DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS".
+     REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES,
+     ENHANCEMENTS, OR MODIFICATIONS.
+*/
+//
+//  qrm_bench.c
+//  qrm_tilde
+//  Offline benchmark and accuracy check for the analysis core. Synthetic modal signals (decaying sinusoids with
+//  known frequencies, amplitudes and decays) go through the same kernels qrm~ runs for a list request: window,
+//  fft, magnitudes, peak picking, Goertzel at the peak bins for the later slices, the decay fit and the fractional
+//  bin refinement. Each stage is timed, and the model is compared with the partials the signal was made from.
+//
+//  qrm_bench [bench] [max_fft_size]   sweep fft_size 512..65536 and peak counts, in both precisions
+//  qrm_bench compare [max_fft_size]   the same sweep, single precision models against double precision ones
+//  qrm_bench check                    fixed cases with error limits; exits non-zero if one is exceeded
+//
+//  Needs FFTW in double and single precision, but not the Max SDK; see CMakeLists.txt in this folder.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "fftw3.h"
+#include "qrm_core.h"
+
+#define BENCH_SR 44100.0
+#define BENCH_SLICES 5              //qrm~'s default num_slices
+#define BENCH_THRESH -32.0          //and its default thresh, dB
+#define BENCH_MIN_FFT 512
+#define BENCH_MAX_FFT 65536
+#define BENCH_MIN_SPACING 6         //bins between neighbouring partials, so every one is a peak of its own
+#define BENCH_SINGLE_FREQ 1e-3      //check: largest difference between the single and double precision models, bins
+#define BENCH_SINGLE_REL 5e-3       //and relative, for amplitudes and decays
+#define BENCH_DECIM 8               //check: what a decimated low band is decimated by
+#define BENCH_DECIM_REL 2e-4        //and how far its magnitudes may be from the full fft's, relative to the loudest
+#define BENCH_WORK 4e7              //rough samples processed per configuration, to pick the repetitions
+
+enum {
+    BENCH_STAGE_WINDOW,
+    BENCH_STAGE_FFT,
+    BENCH_STAGE_SPECTRUM,
+    BENCH_STAGE_PEAKS,
+    BENCH_STAGE_FIT,
+    BENCH_STAGE_REFINE,
+    BENCH_NUM_STAGES
+};
+
+static const char *bench_stage_names[BENCH_NUM_STAGES] = {"window", "fft", "spectrum", "peaks", "fit", "refine"};
+
+//a sum of decaying sinusoids: partial i is amp[i] * exp(-decay[i] * t) * sin(2 pi freq[i] t + phase)
+typedef struct _bench_signal {
+    float *samples;
+    long len;
+    long num;
+    double *freq;
+    double *amp;
+    double *decay;
+}t_bench_signal;
+
+//everything one fft size needs, in both precisions
+typedef struct _bench {
+    long n;
+    long nbins;
+    fftw_plan p;
+    fftwf_plan pf;
+    double *window;
+    float *fwindow;
+    double *in;                 //BENCH_SLICES windows of n samples, back to back
+    float *fin;
+    double *outs;               //slice 0's spectrum
+    float *fouts;
+    double *mag;
+    float *fmag;
+    long *peaks;
+    long idxs[BENCH_SLICES];
+    double *y;                  //peak magnitudes, slice-major, as exp_fit_batch wants them
+    double *sums;
+    double *amps;
+    double *dr;
+    double *model;              //(frequency, amplitude, decay) triples
+    long num;
+}t_bench;
+
+//errors of one model against the signal it came from. Each partial is matched to the nearest peak within two bins.
+typedef struct _bench_error {
+    long found;
+    long extra;                 //peaks matching no partial (window sidelobes, mostly)
+    double freq_max;            //bins
+    double freq_mean;
+    double decay_max;           //relative
+    double decay_mean;
+}t_bench_error;
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//fixed seed, so every run (and every precision) sees the same signals
+static unsigned long bench_seed = 1;
+static double bench_rand(void)
+{
+    bench_seed = bench_seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double)(bench_seed >> 11) / 9007199254740992.0;
+}
+
+//num partials on a jittered grid between 4 bins and 45% of the spectrum of an n point fft, -12..0 dB, decaying
+//by e^2..e^6 over the signal. Returns 0 if they do not fit BENCH_MIN_SPACING bins apart.
+static int bench_signal_make(t_bench_signal *s, long n, long num)
+{
+    double lo = 4, hi = 0.45 * n / 2;
+    double cell = (hi - lo) / num;
+    
+    if(cell < 2 * BENCH_MIN_SPACING) return 0;
+    s->len = MAX(4 * n, (long)(BENCH_SR / 2));
+    s->num = num;
+    s->samples = calloc(s->len, sizeof(float));
+    s->freq = malloc(sizeof(double) * num);
+    s->amp = malloc(sizeof(double) * num);
+    s->decay = malloc(sizeof(double) * num);
+    bench_seed = 1 + n * 131 + num;
+    for(long i=0;i<num;i++){
+        double bin = lo + cell * (i + 0.5 + 0.25 * (2 * bench_rand() - 1));
+        double phase = TWOPI * bench_rand();
+        s->freq[i] = bin * BENCH_SR / n;
+        s->amp[i] = pow(10.0, -12.0 * bench_rand() / 20.0);
+        s->decay[i] = (2 + 4 * bench_rand()) * BENCH_SR / s->len;
+        for(long j=0;j<s->len;j++){
+            double t = j / BENCH_SR;
+            s->samples[j] += (float)(s->amp[i] * exp(-s->decay[i] * t) * sin(TWOPI * s->freq[i] * t + phase));
+        }
+    }
+    return 1;
+}
+
+static void bench_signal_free(t_bench_signal *s)
+{
+    free(s->samples);
+    free(s->freq);
+    free(s->amp);
+    free(s->decay);
+}
+
+static void bench_init(t_bench *b, long n)
+{
+    long np = n / 2;
+    
+    b->n = n;
+    b->nbins = n / 2 + 1;
+    b->window = fftw_malloc(sizeof(double) * n);
+    b->fwindow = fftwf_malloc(sizeof(float) * n);
+    b->in = fftw_malloc(sizeof(double) * n * BENCH_SLICES);
+    b->fin = fftwf_malloc(sizeof(float) * n * BENCH_SLICES);
+    b->outs = fftw_malloc(sizeof(double) * (n + 2));
+    b->fouts = fftwf_malloc(sizeof(float) * (n + 2));
+    b->mag = calloc(b->nbins, sizeof(double));
+    b->fmag = calloc(b->nbins, sizeof(float));
+    b->peaks = malloc(sizeof(long) * np);
+    b->y = malloc(sizeof(double) * np * BENCH_SLICES);
+    b->sums = malloc(sizeof(double) * 5 * np);
+    b->amps = malloc(sizeof(double) * np);
+    b->dr = malloc(sizeof(double) * np);
+    b->model = malloc(sizeof(double) * 3 * np);
+    hann_fill(b->window, b->fwindow, n);
+    //planned like qrm~ (FFTW_MEASURE), before there is anything in the arrays for the planner to overwrite
+    b->p = fftw_plan_dft_r2c_1d((int)n, b->in, (fftw_complex *)b->outs, FFTW_MEASURE);
+    b->pf = fftwf_plan_dft_r2c_1d((int)n, b->fin, (fftwf_complex *)b->fouts, FFTW_MEASURE);
+}
+
+static void bench_free(t_bench *b)
+{
+    fftw_destroy_plan(b->p);
+    fftwf_destroy_plan(b->pf);
+    fftw_free(b->window);
+    fftwf_free(b->fwindow);
+    fftw_free(b->in);
+    fftwf_free(b->fin);
+    fftw_free(b->outs);
+    fftwf_free(b->fouts);
+    free(b->mag);
+    free(b->fmag);
+    free(b->peaks);
+    free(b->y);
+    free(b->sums);
+    free(b->amps);
+    free(b->dr);
+    free(b->model);
+}
+
+//one list analysis of the whole signal, as qrm~ does it with decay_eval sparse and uniform slice spacing: the
+//model goes to b->model, and the seconds each stage took are added to t
+static void bench_analyze(t_bench *b, const t_bench_signal *s, int single, double *t)
+{
+    long n = b->n, nbins = b->nbins;
+    long span = s->len - n;
+    double bw = BENCH_SR / n;
+    double now = bench_now(), max_peak, sum;
+    
+    for(int j=0;j<BENCH_SLICES;j++){
+        const float *src = s->samples + j * (span / (BENCH_SLICES - 1));
+        b->idxs[j] = j * (span / (BENCH_SLICES - 1));
+        if(single){
+            for(long i=0;i<n;i++) b->fin[j*n+i] = src[i] * b->fwindow[i];
+        } else {
+            for(long i=0;i<n;i++) b->in[j*n+i] = src[i] * b->window[i];
+        }
+    }
+    t[BENCH_STAGE_WINDOW] += bench_now() - now; now = bench_now();
+    
+    if(single)
+        fftwf_execute_dft_r2c(b->pf, b->fin, (fftwf_complex *)b->fouts);
+    else
+        fftw_execute_dft_r2c(b->p, b->in, (fftw_complex *)b->outs);
+    t[BENCH_STAGE_FFT] += bench_now() - now; now = bench_now();
+    
+    if(single)
+        spectrum_mags_f(b->fouts, nbins, b->fmag, &sum, &max_peak);
+    else
+        spectrum_mags(b->outs, nbins, b->mag, &sum, &max_peak);
+    t[BENCH_STAGE_SPECTRUM] += bench_now() - now; now = bench_now();
+    
+    if(single){
+        b->num = find_peaks_f(b->fmag, nbins, peak_floor(max_peak, BENCH_THRESH), b->peaks, n / 2);
+        peak_mags_widen(b->fmag, b->peaks, b->num, b->mag);
+    } else {
+        b->num = find_peaks(b->mag, nbins, peak_floor(max_peak, BENCH_THRESH), b->peaks, n / 2);
+    }
+    t[BENCH_STAGE_PEAKS] += bench_now() - now; now = bench_now();
+    
+    for(long i=0;i<b->num;i++){
+        long k = b->peaks[i];
+        b->y[i] = b->mag[k];
+        if(single)
+            goertzel_mags_f(b->fin + n, n, BENCH_SLICES - 1, n, n, k, b->y + b->num + i, b->num);
+        else
+            goertzel_mags(b->in + n, n, BENCH_SLICES - 1, n, n, k, b->y + b->num + i, b->num);
+    }
+    exp_fit_batch(b->idxs, BENCH_SLICES, b->y, b->num, 10, b->sums, b->amps, b->dr);
+    t[BENCH_STAGE_FIT] += bench_now() - now; now = bench_now();
+    
+    for(long i=0;i<b->num;i++){
+        b->model[3*i] = frac_bin(b->mag, b->peaks[i]) * bw;
+        b->model[3*i+1] = b->amps[i] / max_peak;
+        b->model[3*i+2] = ABS(b->dr[i] * BENCH_SR);     //qrm~ clamps this to at least 2; the raw fit is compared here
+    }
+    t[BENCH_STAGE_REFINE] += bench_now() - now;
+}
+
+static void bench_error(const t_bench *b, const t_bench_signal *s, t_bench_error *e)
+{
+    double bw = BENCH_SR / b->n;
+    
+    memset(e, 0, sizeof(t_bench_error));
+    for(long i=0;i<s->num;i++){
+        long best = -1;
+        for(long k=0;k<b->num;k++){
+            if(best < 0 || ABS(b->model[3*k] - s->freq[i]) < ABS(b->model[3*best] - s->freq[i])) best = k;
+        }
+        if(best < 0 || ABS(b->model[3*best] - s->freq[i]) > 2 * bw) continue;
+        double fe = ABS(b->model[3*best] - s->freq[i]) / bw;
+        double de = ABS(b->model[3*best+2] - s->decay[i]) / s->decay[i];
+        e->found++;
+        e->freq_max = MAX(e->freq_max, fe);
+        e->freq_mean += fe;
+        e->decay_max = MAX(e->decay_max, de);
+        e->decay_mean += de;
+    }
+    e->extra = b->num - e->found;
+    if(e->found){
+        e->freq_mean /= e->found;
+        e->decay_mean /= e->found;
+    }
+}
+
+//how far the single precision model is from the double precision one of the same signal: partials the two do not
+//have in common, and the largest frequency (bins), amplitude and decay (relative) differences between the rest
+typedef struct _bench_diff {
+    long unmatched;
+    double freq;
+    double amp;
+    double decay;
+}t_bench_diff;
+
+static void bench_diff(t_bench *b, const t_bench_signal *s, t_bench_diff *d)
+{
+    double t[BENCH_NUM_STAGES] = {0};
+    double *ref;
+    long num;
+    
+    bench_analyze(b, s, 0, t);
+    num = b->num;
+    ref = malloc(sizeof(double) * MAX(1, num * 3));
+    memcpy(ref, b->model, sizeof(double) * num * 3);
+    bench_analyze(b, s, 1, t);
+    memset(d, 0, sizeof(t_bench_diff));
+    d->unmatched = ABS(b->num - num);
+    for(long i=0, k=0;i<num;i++){
+        //both lists are in ascending frequency; a peak only one precision found is skipped over
+        while(k < b->num && b->model[3*k] < ref[3*i] - BENCH_SR / b->n) k++;
+        if(k == b->num || ABS(b->model[3*k] - ref[3*i]) > BENCH_SR / b->n){
+            d->unmatched++;
+            continue;
+        }
+        d->freq = MAX(d->freq, ABS(b->model[3*k] - ref[3*i]) * b->n / BENCH_SR);
+        d->amp = MAX(d->amp, ABS(b->model[3*k+1] - ref[3*i+1]) / ref[3*i+1]);
+        d->decay = MAX(d->decay, ABS(b->model[3*k+2] - ref[3*i+2]) / ref[3*i+2]);
+        k++;
+    }
+    free(ref);
+}
+
+//the sweep: per-stage latency (mean microseconds per analysis), throughput, and the model's errors
+static int bench_run(long max_n)
+{
+    static const long counts[] = {4, 16, 64, 256};
+    
+    printf("%6s %5s %6s", "fft", "peaks", "prec");
+    for(int k=0;k<BENCH_NUM_STAGES;k++) printf(" %9s", bench_stage_names[k]);
+    printf(" %10s %9s %6s %5s %9s %9s %9s %9s\n", "total us", "frames/s", "found", "extra",
+           "f max", "f mean", "d max", "d mean");
+    for(long n=BENCH_MIN_FFT; n<=max_n; n*=2){
+        t_bench b;
+        bench_init(&b, n);
+        for(size_t c=0;c<sizeof(counts)/sizeof(counts[0]);c++){
+            t_bench_signal s;
+            if(!bench_signal_make(&s, n, counts[c])) continue;
+            long reps = MAX(3, (long)(BENCH_WORK / (n * BENCH_SLICES)));
+            for(int single=0; single<2; single++){
+                double t[BENCH_NUM_STAGES] = {0}, total = 0;
+                t_bench_error e;
+                bench_analyze(&b, &s, single, t);       //warm up
+                memset(t, 0, sizeof(t));
+                for(long r=0;r<reps;r++) bench_analyze(&b, &s, single, t);
+                bench_error(&b, &s, &e);
+                printf("%6ld %5ld %6s", n, s.num, single ? "single" : "double");
+                for(int k=0;k<BENCH_NUM_STAGES;k++){
+                    printf(" %9.2f", t[k] / reps * 1e6);
+                    total += t[k] / reps;
+                }
+                printf(" %10.2f %9.0f %3ld/%-2ld %5ld %9.5f %9.5f %9.5f %9.5f\n", total * 1e6, 1 / total,
+                       e.found, s.num, e.extra, e.freq_max, e.freq_mean, e.decay_max, e.decay_mean);
+            }
+            bench_signal_free(&s);
+        }
+        bench_free(&b);
+    }
+    return 0;
+}
+
+//the precision sweep: what running the pipeline in single precision costs in accuracy, next to the double one
+static int bench_compare(long max_n)
+{
+    static const long counts[] = {4, 16, 64, 256};
+    
+    printf("%6s %5s %9s %9s %9s %9s\n", "fft", "peaks", "unmatched", "f bins", "amp rel", "decay rel");
+    for(long n=BENCH_MIN_FFT; n<=max_n; n*=2){
+        t_bench b;
+        bench_init(&b, n);
+        for(size_t c=0;c<sizeof(counts)/sizeof(counts[0]);c++){
+            t_bench_signal s;
+            t_bench_diff d;
+            if(!bench_signal_make(&s, n, counts[c])) continue;
+            bench_diff(&b, &s, &d);
+            printf("%6ld %5ld %9ld %9.2e %9.2e %9.2e\n", n, s.num, d.unmatched, d.freq, d.amp, d.decay);
+            bench_signal_free(&s);
+        }
+        bench_free(&b);
+    }
+    return 0;
+}
+
+//regression limits for the check: every partial found, frequency within freq_max bins, decay within decay_max
+//(relative). On these clean exponentials the weighted fit is exact up to the leakage between partials.
+typedef struct _bench_case {
+    long n;
+    long num;
+    double freq_max;
+    double decay_max;
+}t_bench_case;
+
+static const t_bench_case bench_cases[] = {
+    {1024, 4, 0.05, 0.01},
+    {4096, 8, 0.05, 0.01},
+    {16384, 32, 0.05, 0.01},
+    {65536, 64, 0.05, 0.01},
+};
+
+//qrm~'s decimated low band: slice 0 windowed at n, halfband_decimate'd BENCH_DECIM times over and transformed at
+//n/BENCH_DECIM, against the n point fft's bins up to the decimated band's passband, scaled by 1/BENCH_DECIM. The
+//signal's partials above that are what the filters have to keep out. Returns the largest difference, relative to
+//the loudest bin of the full spectrum.
+static double bench_decimate_error(t_bench *b, const t_bench_signal *s, int single)
+{
+    long n = b->n, m = n / BENCH_DECIM;
+    double *in = fftw_malloc(sizeof(double) * n), *outs = fftw_malloc(sizeof(double) * (m + 2));
+    float *fin = fftwf_malloc(sizeof(float) * n), *fouts = fftwf_malloc(sizeof(float) * (m + 2));
+    double err = 0, max = 0;
+    
+    for(long i=0;i<n;i++){
+        b->in[i] = s->samples[i] * b->window[i];
+        b->fin[i] = s->samples[i] * b->fwindow[i];
+    }
+    //each stage into the scratch after the one before, as qrm~ does
+    if(single){
+        const float *src = b->fin;
+        for(long k=n, off=0; k>m; off+=k/2, k/=2){
+            halfband_decimate_f(src, k, fin + off);
+            src = fin + off;
+        }
+        fftwf_plan p = fftwf_plan_dft_r2c_1d((int)m, (float *)src, (fftwf_complex *)fouts, FFTW_ESTIMATE);
+        fftwf_execute(p);
+        fftwf_destroy_plan(p);
+        fftwf_execute(b->pf);
+    } else {
+        const double *src = b->in;
+        for(long k=n, off=0; k>m; off+=k/2, k/=2){
+            halfband_decimate(src, k, in + off);
+            src = in + off;
+        }
+        fftw_plan p = fftw_plan_dft_r2c_1d((int)m, (double *)src, (fftw_complex *)outs, FFTW_ESTIMATE);
+        fftw_execute(p);
+        fftw_destroy_plan(p);
+        fftw_execute(b->p);
+    }
+    for(long k=0;k<b->nbins;k++){
+        double re = single ? b->fouts[2*k] : b->outs[2*k], im = single ? b->fouts[2*k+1] : b->outs[2*k+1];
+        double full = sqrt(re*re + im*im);
+        max = MAX(max, full);
+        if(k >= m/4) continue;
+        re = single ? fouts[2*k] : outs[2*k];
+        im = single ? fouts[2*k+1] : outs[2*k+1];
+        err = MAX(err, ABS(sqrt(re*re + im*im) - full / BENCH_DECIM));
+    }
+    fftw_free(in);
+    fftw_free(outs);
+    fftwf_free(fin);
+    fftwf_free(fouts);
+    return err / max;
+}
+
+static int bench_check(void)
+{
+    int failed = 0;
+    
+    for(size_t c=0;c<sizeof(bench_cases)/sizeof(bench_cases[0]);c++){
+        const t_bench_case *k = bench_cases + c;
+        t_bench b;
+        t_bench_signal s;
+        bench_init(&b, k->n);
+        bench_signal_make(&s, k->n, k->num);
+        for(int single=0; single<2; single++){
+            double t[BENCH_NUM_STAGES] = {0};
+            t_bench_error e;
+            bench_analyze(&b, &s, single, t);
+            bench_error(&b, &s, &e);
+            int ok = e.found == s.num && e.freq_max <= k->freq_max && e.decay_max <= k->decay_max;
+            printf("%s fft %ld, %ld partials, %s: found %ld, frequency error %.5f bins (limit %.3f), decay error %.5f (limit %.3f)\n",
+                   ok ? "ok  " : "FAIL", k->n, k->num, single ? "single" : "double", e.found, e.freq_max, k->freq_max,
+                   e.decay_max, k->decay_max);
+            failed |= !ok;
+        }
+        //and the single precision model may only differ from the double one by rounding
+        t_bench_diff d;
+        bench_diff(&b, &s, &d);
+        int ok = !d.unmatched && d.freq <= BENCH_SINGLE_FREQ && d.amp <= BENCH_SINGLE_REL && d.decay <= BENCH_SINGLE_REL;
+        printf("%s fft %ld, %ld partials, single against double: unmatched %ld, frequency %.2e bins, amplitude %.2e, decay %.2e\n",
+               ok ? "ok  " : "FAIL", k->n, k->num, d.unmatched, d.freq, d.amp, d.decay);
+        failed |= !ok;
+        //a decimated low band keeps the full fft's bins
+        for(int single=0; single<2; single++){
+            double err = bench_decimate_error(&b, &s, single);
+            ok = err <= BENCH_DECIM_REL;
+            printf("%s fft %ld, %ld partials, %s, decimated by %d: magnitude error %.2e (limit %.0e)\n",
+                   ok ? "ok  " : "FAIL", k->n, k->num, single ? "single" : "double", BENCH_DECIM, err, BENCH_DECIM_REL);
+            failed |= !ok;
+        }
+        bench_signal_free(&s);
+        bench_free(&b);
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    qrm_core_init();
+    if(argc > 1 && !strcmp(argv[1], "check"))
+        return bench_check();
+    long max_n = argc > 2 ? MIN(BENCH_MAX_FFT, MAX(BENCH_MIN_FFT, atol(argv[2]))) : BENCH_MAX_FFT;
+    if(argc > 1 && !strcmp(argv[1], "compare"))
+        return bench_compare(max_n);
+    if(argc > 1 && strcmp(argv[1], "bench")){
+        fprintf(stderr, "usage: %s [bench [max_fft_size] | compare [max_fft_size] | check]\n", argv[0]);
+        return 2;
+    }
+    return bench_run(max_n);
+}
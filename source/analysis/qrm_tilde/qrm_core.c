@@ -0,0 +1,617 @@
+/*
+Copyright (c) 2022.  The Regents of the University of California (Regents).
+All Rights Reserved.
+
+Permission to use, copy, modify, and distribute this software and its
+documentation for educational, research, and not-for-profit purposes, without
+fee and without a signed licensing agreement, is hereby granted, provided that
+the above copyright notice, this paragraph and the following two paragraphs
+appear in all copies, modifications, and distributions.  Contact The Office of
+Technology Licensing, UC Berkeley, 2150 Shattuck Avenue, Suite 510, Berkeley,
+CA 94720-1620, (510) 643-7201, for commercial licensing opportunities.
+
+Written by Jeremy L. Wagner, The Center for New Music and Audio Technologies,
+University of California, Berkeley.
+
+     IN NO EVENT SHALL REGENTS BE LIABLE TO ANY PARTY FOR DIRECT, INDIRECT,
+     SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES, INCLUDING LOST PROFITS,
+     ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF
+     REGENTS HAS BEEN ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+     REGENTS SPECIFICALLY DISCLAIMS ANY WARRANTIES, INCLUDING, BUT NOT
+     LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+     FOR A PARTICULAR PURPOSE. THE SOFTWARE AND ACCOMPANYING
+     DOCUMENTATION, IF ANY, PROVIDED HEREUNDER IS PROVIDED "AS IS".
+     REGENTS HAS NO OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES,
+     ENHANCEMENTS, OR MODIFICATIONS.
+*/
+//
+//  qrm_core.c
+//  qrm_tilde
+//  The numerical kernels of qrm~: windowing, spectra, peak picking, fractional bin refinement, the decay fit
+//  and the attack search. Nothing here depends on the Max SDK or on FFTW, so these build on their own for
+//  offline benchmarks and accuracy checks; the ffts themselves are left to the caller.
+//
+
+#include <math.h>
+#include <string.h>
+#include "qrm_core.h"
+
+//fused magnitude/sum/max passes over interleaved complex bins, set to the best kernel for this cpu by qrm_core_init
+void (*spectrum_mags)(const double *outs, long nbins, double *mag, double *sum, double *max) = spectrum_mags_scalar;
+void (*spectrum_mags_f)(const float *outs, long nbins, float *mag, double *sum, double *max) = spectrum_mags_f_scalar;
+
+//abs-max over contiguous samples, likewise
+static float abs_max_contiguous(const float *tab, long n)
+{
+    return abs_max_scalar(tab, n, 1);
+}
+static float (*abs_max)(const float *tab, long n) = abs_max_contiguous;
+
+//pick the vector kernels this cpu can run; call once before any analysis
+void qrm_core_init(void)
+{
+#ifdef QRM_HAVE_AVX2
+    if(__builtin_cpu_supports("avx2")){
+        spectrum_mags = spectrum_mags_avx2;
+        spectrum_mags_f = spectrum_mags_f_avx2;
+        abs_max = abs_max_avx2;
+    }
+#elif defined(QRM_HAVE_NEON)
+    spectrum_mags = spectrum_mags_neon;
+    spectrum_mags_f = spectrum_mags_f_neon;
+    abs_max = abs_max_neon;
+#endif
+}
+
+//n points of a periodic hann window, in double and (if wf is not NULL) single precision
+void hann_fill(double *w, float *wf, long n)
+{
+    for(long i=0;i<n;i++){
+        w[i] = pow(sin(PI*i / n),2);
+        if(wf) wf[i] = (float)w[i];
+    }
+}
+
+//fractional bin position of the peak at bin k of a magnitude spectrum
+// /fractional_bins = [ 0, log(/spectrum[[/i+1]] / /spectrum[[/i -1]]) / (2 * log(pow(/spectrum[[/i]],2) / (/spectrum[[/i-1]] * /spectrum[[/i+1]]))), 0 ],
+double frac_bin(const double *mag, long k)
+{
+    //the following can be found in the literature on fractional bin extraction
+    //the log functions improve accuracy, but could be omitted or other numerical methods tried for efficiency
+    return k + log(mag[k+1]/mag[k - 1]) / (2*log(pow(mag[k],2) / (mag[k+1] * mag[k - 1])) );
+}
+
+//method to perform exponential fitting via least squares
+//the bias term 'wt' allows for weighting the initial value to ensure closer approximation of amplitude
+void exp_fit(long *xVals, double *yVals, long n, double* out, double wt)
+{
+//    double *out = malloc(sizeof(double)*2);
+    out[0] =0;
+    out[1] = 0;
+    double sum_Y=0;
+    double sum_XY=0;
+    double sum_X2Y=0;
+    double sum_YlnY=0;
+    double sum_XYlnY=0;
+    double bias = wt;
+    
+    for(int i=0;i<n;i++){
+        if(i==0 || i==n-1){ bias=wt;}else{bias = 1.0;}
+        double XY = bias*(double)(xVals[i] * yVals[i]);
+        double X2Y = ((double)xVals[i]) * XY;
+        double YlnY = bias*(yVals[i] * log(yVals[i]));
+        double XYlnY = (double)xVals[i] * YlnY;
+        
+        sum_Y += bias*yVals[i];
+        sum_XY += XY;
+        sum_X2Y += X2Y;
+        sum_YlnY += YlnY;
+        sum_XYlnY += XYlnY;
+    }
+//    post("qrm:XY: %f, %f, %f, %f, %f", sum_Y, sum_XY, sum_X2Y, sum_YlnY, sum_XYlnY);
+    
+    double den = sum_Y * sum_X2Y - sum_XY * sum_XY + EPSILON;
+    
+    out[0] = exp((sum_X2Y * sum_YlnY - sum_XY * sum_XYlnY)/(den));
+    out[1] = (sum_Y * sum_XYlnY - sum_XY * sum_YlnY)/(den);
+    
+//    post("%f", out[0]);
+//    post("%f", out[1]);
+//    return out;
+}
+
+//exp_fit for np peaks at once: y is slice-major, y[j*np+i] being peak i at xVals[j], and EPSILON is added to
+//every y here. A and B get np results each; sums is 5*np of scratch. The loops run across peaks with no branches
+//so they vectorize; the log per sample is what the log-domain fit needs, and vectorizes too where the compiler
+//has a vector math library.
+void exp_fit_batch(long *xVals, long n, const double *y, long np, double wt, double *sums, double *A, double *B)
+{
+    double *sum_Y = sums, *sum_XY = sums + np, *sum_X2Y = sums + 2*np, *sum_YlnY = sums + 3*np, *sum_XYlnY = sums + 4*np;
+    
+    for(long i=0;i<5*np;i++) sums[i] = 0;
+    for(long j=0;j<n;j++){
+        double bias = (j==0 || j==n-1) ? wt : 1.0;
+        double X = (double)xVals[j];
+        const double *row = y + j*np;
+        for(long i=0;i<np;i++){
+            double Y = row[i] + EPSILON;
+            double YlnY = bias * Y * log(Y);
+            double XY = bias * X * Y;
+            sum_Y[i] += bias * Y;
+            sum_XY[i] += XY;
+            sum_X2Y[i] += X * XY;
+            sum_YlnY[i] += YlnY;
+            sum_XYlnY[i] += X * YlnY;
+        }
+    }
+    for(long i=0;i<np;i++){
+        double den = sum_Y[i] * sum_X2Y[i] - sum_XY[i] * sum_XY[i] + EPSILON;
+        A[i] = exp((sum_X2Y[i] * sum_YlnY[i] - sum_XY[i] * sum_XYlnY[i])/(den));
+        B[i] = (sum_Y[i] * sum_XYlnY[i] - sum_XY[i] * sum_YlnY[i])/(den);
+    }
+}
+
+//magnitude of n-point dft bin k for each of count windows, starting at in and dist samples apart, into mags,
+//mstride apart, using the Goertzel recursion. Only the first len samples of each window are read; the rest are
+//taken to be zero padding, which would only turn the recursion's state without changing the magnitude.
+//The windows share the bin's coefficient, so they advance through the samples together.
+void goertzel_mags(double *in, long dist, long count, long n, long len, long k, double *mags, long mstride)
+{
+    double coeff = 2*cos(TWOPI*k / n);
+    double s0, s1[QRM_MAX_SLICES], s2[QRM_MAX_SLICES];
+    
+    for(long j=0;j<count;j++){ s1[j]=0; s2[j]=0; }
+    for(long i=0;i<len;i++){
+        for(long j=0;j<count;j++){
+            s0 = in[j*dist+i] + coeff*s1[j] - s2[j];
+            s2[j] = s1[j];
+            s1[j] = s0;
+        }
+    }
+    for(long j=0;j<count;j++)
+        mags[j*mstride] = sqrt(MAX(0.0, s1[j]*s1[j] + s2[j]*s2[j] - coeff*s1[j]*s2[j]));
+}
+
+//goertzel_mags reading float windows. The recursion itself stays in double: in float its error grows with n,
+//and badly so for low bins, where coeff is close to 2.
+void goertzel_mags_f(float *in, long dist, long count, long n, long len, long k, double *mags, long mstride)
+{
+    double coeff = 2*cos(TWOPI*k / n);
+    double s0, s1[QRM_MAX_SLICES], s2[QRM_MAX_SLICES];
+    
+    for(long j=0;j<count;j++){ s1[j]=0; s2[j]=0; }
+    for(long i=0;i<len;i++){
+        for(long j=0;j<count;j++){
+            s0 = in[j*dist+i] + coeff*s1[j] - s2[j];
+            s2[j] = s1[j];
+            s1[j] = s0;
+        }
+    }
+    for(long j=0;j<count;j++)
+        mags[j*mstride] = sqrt(MAX(0.0, s1[j]*s1[j] + s2[j]*s2[j] - coeff*s1[j]*s2[j]));
+}
+
+//magnitudes of np partials followed through count windows of len samples, hop samples apart, starting at in:
+//mags[j*np+i] is the Hann-windowed len-sample dft of the window at in + j*hop at bin k[i] of an n-point fft, as
+//the fft of that window zero-padded to n would have it. Each partial keeps a sliding dft at its frequency and at
+//one window bin either side, which is all the Hann window needs, and each sample updates them in O(np).
+//state is 18*np of scratch.
+void sdft_track(const float *in, long count, long hop, long n, long len, const long *k, long np, double *mags, double *state)
+{
+    double *sr = state, *si = state + 3*np;             //sliding dfts, phase referenced to the window start
+    double *rr = state + 6*np, *ri = state + 9*np;      //per sample rotation e^(jw)
+    double *er = state + 12*np, *ei = state + 15*np;    //entry twiddle e^(-jw(len-1))
+    long end = (count-1) * hop + len;
+    long next = 0;                                      //window whose last sample is due
+    
+    for(long f=0;f<3;f++){
+        for(long i=0;i<np;i++){
+            double w = TWOPI * k[i] / n + (f-1) * TWOPI / len;
+            long q = f*np + i;
+            sr[q] = si[q] = 0;
+            rr[q] = cos(w);
+            ri[q] = sin(w);
+            er[q] = cos(w * (len-1));
+            ei[q] = -sin(w * (len-1));
+        }
+    }
+    for(long t=0;t<end;t++){
+        double xn = in[t];
+        double xo = t >= len ? in[t-len] : 0;
+        for(long q=0;q<3*np;q++){
+            double ar = sr[q] - xo, ai = si[q];
+            sr[q] = rr[q]*ar - ri[q]*ai + xn*er[q];
+            si[q] = rr[q]*ai + ri[q]*ar + xn*ei[q];
+        }
+        if(t == next * hop + len - 1){
+            double *m = mags + next*np;
+            for(long i=0;i<np;i++){
+                double hr = 0.5*sr[np+i] - 0.25*(sr[i] + sr[2*np+i]);
+                double hi = 0.5*si[np+i] - 0.25*(si[i] + si[2*np+i]);
+                m[i] = sqrt(hr*hr + hi*hi);
+            }
+            next++;
+        }
+    }
+}
+
+//one side of a 31-tap half-band lowpass (Kaiser window, beta 8), for the odd taps 1, 3, .. 15; the centre tap is
+//1/2 and the even ones are 0. Flat to 6e-5 up to an eighth of the input rate, 85 dB down from three eighths on.
+static const double halfband[QRM_HALFBAND_TAPS] = {
+    0.31368938837956351, -0.092926518334197572, 0.043797795214949427, -0.021456618006382603,
+    0.0097684015419471429, -0.0038254521164517523, 0.0011567156268735763, -0.00020371230630170556
+};
+
+//filter n samples with the half-band lowpass, taking them as one period of a periodic signal, and keep every
+//other one: n/2 samples into out (not in place). The n/2-point dft of out is then exactly half the n-point dft of
+//in times the filter's response, up to aliasing from the stopband, so bins below an eighth of the input rate keep
+//their frequency and come out at half their magnitude. n is even and at least 4*QRM_HALFBAND_TAPS.
+void halfband_decimate(const double *in, long n, double *out)
+{
+    long edge = QRM_HALFBAND_TAPS;      //outputs whose taps would wrap, at either end
+
+    for(long m=0;m<n/2;m++){
+        long c = 2*m;
+        double acc = 0.5 * in[c];
+        if(m >= edge && m < n/2 - edge){
+            for(long i=0;i<QRM_HALFBAND_TAPS;i++)
+                acc += halfband[i] * (in[c - 2*i - 1] + in[c + 2*i + 1]);
+        } else {
+            for(long i=0;i<QRM_HALFBAND_TAPS;i++)
+                acc += halfband[i] * (in[(c - 2*i - 1 + n) % n] + in[(c + 2*i + 1) % n]);
+        }
+        out[m] = acc;
+    }
+}
+
+//halfband_decimate over float samples; the sums are carried in double
+void halfband_decimate_f(const float *in, long n, float *out)
+{
+    long edge = QRM_HALFBAND_TAPS;
+
+    for(long m=0;m<n/2;m++){
+        long c = 2*m;
+        double acc = 0.5 * in[c];
+        if(m >= edge && m < n/2 - edge){
+            for(long i=0;i<QRM_HALFBAND_TAPS;i++)
+                acc += halfband[i] * ((double)in[c - 2*i - 1] + in[c + 2*i + 1]);
+        } else {
+            for(long i=0;i<QRM_HALFBAND_TAPS;i++)
+                acc += halfband[i] * ((double)in[(c - 2*i - 1 + n) % n] + in[(c + 2*i + 1) % n]);
+        }
+        out[m] = (float)acc;
+    }
+}
+
+//magnitude of each of nbins interleaved complex bins, plus their sum and maximum
+void spectrum_mags_scalar(const double *outs, long nbins, double *mag, double *sum, double *max)
+{
+    double s = 0, m = 0, t;
+    
+    for(long i=0;i<nbins;i++){
+        t = sqrt(outs[2*i]*outs[2*i] + outs[2*i+1]*outs[2*i+1]);
+        s += t;
+        if(t > m) m = t;
+        mag[i] = t;
+    }
+    *sum = s;
+    *max = m;
+}
+
+#ifdef QRM_HAVE_AVX2
+//four bins per step: square, pairwise add re^2+im^2, restore bin order, sqrt
+__attribute__((target("avx2")))
+void spectrum_mags_avx2(const double *outs, long nbins, double *mag, double *sum, double *max)
+{
+    __m256d vs = _mm256_setzero_pd();
+    __m256d vm = _mm256_setzero_pd();
+    double s, m, lanes[4];
+    long i = 0;
+    
+    for(;i+4<=nbins;i+=4){
+        __m256d a = _mm256_loadu_pd(outs + 2*i);        //re0 im0 re1 im1
+        __m256d b = _mm256_loadu_pd(outs + 2*i + 4);    //re2 im2 re3 im3
+        __m256d p = _mm256_hadd_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));  //|0|^2 |2|^2 |1|^2 |3|^2
+        __m256d v = _mm256_sqrt_pd(_mm256_permute4x64_pd(p, 0xD8));
+        _mm256_storeu_pd(mag + i, v);
+        vs = _mm256_add_pd(vs, v);
+        vm = _mm256_max_pd(vm, v);
+    }
+    _mm256_storeu_pd(lanes, vs);
+    s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_pd(lanes, vm);
+    m = MAX(MAX(lanes[0], lanes[1]), MAX(lanes[2], lanes[3]));
+    
+    spectrum_mags_scalar(outs + 2*i, nbins - i, mag + i, sum, max);
+    *sum += s;
+    *max = MAX(*max, m);
+}
+#endif
+
+#ifdef QRM_HAVE_NEON
+//two bins per step; vld2 splits re and im for us
+void spectrum_mags_neon(const double *outs, long nbins, double *mag, double *sum, double *max)
+{
+    float64x2_t vs = vdupq_n_f64(0);
+    float64x2_t vm = vdupq_n_f64(0);
+    double s, m;
+    long i = 0;
+    
+    for(;i+2<=nbins;i+=2){
+        float64x2x2_t c = vld2q_f64(outs + 2*i);
+        float64x2_t v = vsqrtq_f64(vfmaq_f64(vmulq_f64(c.val[0], c.val[0]), c.val[1], c.val[1]));
+        vst1q_f64(mag + i, v);
+        vs = vaddq_f64(vs, v);
+        vm = vmaxq_f64(vm, v);
+    }
+    s = vaddvq_f64(vs);
+    m = vmaxvq_f64(vm);
+    
+    spectrum_mags_scalar(outs + 2*i, nbins - i, mag + i, sum, max);
+    *sum += s;
+    *max = MAX(*max, m);
+}
+#endif
+
+//single precision kernels. Magnitudes stay float; the sum is carried in double, since it runs over every bin
+void spectrum_mags_f_scalar(const float *outs, long nbins, float *mag, double *sum, double *max)
+{
+    double s = 0;
+    float m = 0, t;
+    
+    for(long i=0;i<nbins;i++){
+        t = sqrtf(outs[2*i]*outs[2*i] + outs[2*i+1]*outs[2*i+1]);
+        s += t;
+        if(t > m) m = t;
+        mag[i] = t;
+    }
+    *sum = s;
+    *max = m;
+}
+
+#ifdef QRM_HAVE_AVX2
+//eight bins per step, the float version of spectrum_mags_avx2. Each step's eight magnitudes are summed in
+//double, four at a time, so long spectra do not lose their small bins to rounding.
+__attribute__((target("avx2")))
+void spectrum_mags_f_avx2(const float *outs, long nbins, float *mag, double *sum, double *max)
+{
+    __m256d vs = _mm256_setzero_pd();
+    __m256 vm = _mm256_setzero_ps();
+    double s, lanes[4];
+    float m, flanes[8];
+    long i = 0;
+    
+    for(;i+8<=nbins;i+=8){
+        __m256 a = _mm256_loadu_ps(outs + 2*i);         //re0 im0 .. re3 im3
+        __m256 b = _mm256_loadu_ps(outs + 2*i + 8);     //re4 im4 .. re7 im7
+        __m256 p = _mm256_hadd_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));  //|0| |1| |4| |5| |2| |3| |6| |7|, squared
+        __m256 v = _mm256_sqrt_ps(_mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(p), 0xD8)));
+        _mm256_storeu_ps(mag + i, v);
+        vs = _mm256_add_pd(vs, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1))));
+        vm = _mm256_max_ps(vm, v);
+    }
+    _mm256_storeu_pd(lanes, vs);
+    s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_ps(flanes, vm);
+    m = 0;
+    for(int j=0;j<8;j++) m = MAX(m, flanes[j]);
+    
+    spectrum_mags_f_scalar(outs + 2*i, nbins - i, mag + i, sum, max);
+    *sum += s;
+    *max = MAX(*max, m);
+}
+#endif
+
+#ifdef QRM_HAVE_NEON
+//four bins per step
+void spectrum_mags_f_neon(const float *outs, long nbins, float *mag, double *sum, double *max)
+{
+    float64x2_t vs = vdupq_n_f64(0);
+    float32x4_t vm = vdupq_n_f32(0);
+    double s;
+    float m;
+    long i = 0;
+    
+    for(;i+4<=nbins;i+=4){
+        float32x4x2_t c = vld2q_f32(outs + 2*i);
+        float32x4_t v = vsqrtq_f32(vfmaq_f32(vmulq_f32(c.val[0], c.val[0]), c.val[1], c.val[1]));
+        vst1q_f32(mag + i, v);
+        vs = vaddq_f64(vs, vaddq_f64(vcvt_f64_f32(vget_low_f32(v)), vcvt_high_f64_f32(v)));
+        vm = vmaxq_f32(vm, v);
+    }
+    s = vaddvq_f64(vs);
+    m = vmaxvq_f32(vm);
+    
+    spectrum_mags_f_scalar(outs + 2*i, nbins - i, mag + i, sum, max);
+    *sum += s;
+    *max = MAX(*max, m);
+}
+#endif
+
+//find_peaks over a float spectrum
+long find_peaks_f(const float *mag, long nbins, double floor, long *peaks, long max_peaks)
+{
+    unsigned char hit[QRM_PEAK_BLOCK];
+    float f = (float)floor;
+    long c = 0;
+    
+    for(long b=1; b<nbins-1 && c<max_peaks; b+=QRM_PEAK_BLOCK){
+        long n = MIN(QRM_PEAK_BLOCK, nbins-1-b);
+        const float *m = mag + b;
+        for(long i=0;i<n;i++)
+            hit[i] = (m[i] > m[i-1]) & (m[i] > m[i+1]) & (m[i] > f);
+        for(long i=0;i<n && c<max_peaks;i++){
+            peaks[c] = b+i;
+            c += hit[i];
+        }
+    }
+    if(c < max_peaks) peaks[c] = -1;
+    return c;
+}
+
+//the fractional bin estimate and the fit read the double spectrum at the peaks and their neighbours only,
+//so that is all that is copied over from the float one
+void peak_mags_widen(const float *fmag, const long *peaks, long num_peaks, double *mag)
+{
+    for(long i=0;i<num_peaks;i++){
+        long k = peaks[i];
+        mag[k-1] = fmag[k-1];
+        mag[k] = fmag[k];
+        mag[k+1] = fmag[k+1];
+    }
+}
+
+//the threshold is in dB relative to the loudest bin; as a linear magnitude it only needs working out once per spectrum
+double peak_floor(double max_peak, double thresh)
+{
+    return max_peak * pow(10.0, thresh / 20.0);
+}
+
+//peak picking: bins 1..nbins-2 that are strict local maxima and louder than floor, in ascending order.
+//at most max_peaks are written; if there is room, the list is terminated with -1.
+//each block is first tested without branches (so the comparisons vectorize), then compacted into peaks.
+long find_peaks(const double *mag, long nbins, double floor, long *peaks, long max_peaks)
+{
+    unsigned char hit[QRM_PEAK_BLOCK];
+    long c = 0;
+    
+    for(long b=1; b<nbins-1 && c<max_peaks; b+=QRM_PEAK_BLOCK){
+        long n = MIN(QRM_PEAK_BLOCK, nbins-1-b);
+        const double *m = mag + b;
+        for(long i=0;i<n;i++)
+            hit[i] = (m[i] > m[i-1]) & (m[i] > m[i+1]) & (m[i] > floor);
+        for(long i=0;i<n && c<max_peaks;i++){
+            peaks[c] = b+i;
+            c += hit[i];
+        }
+    }
+    if(c < max_peaks) peaks[c] = -1;
+    return c;
+}
+
+//merge runs of neighbouring partials closer than tol Hz, in place. a holds num partials of width values each
+//(frequency, amplitude[, decay]) in ascending frequency. A run keeps the amplitude-weighted mean frequency and
+//decay and the root of its summed squared amplitudes, so it keeps its energy. Returns the partials left.
+long partials_merge(double *a, long num, long width, double tol)
+{
+    long n = 0;
+    
+    for(long i=0;i<num;i++){
+        double *p = a + i*width;
+        double *q = n ? a + (n-1)*width : NULL;
+        if(q && p[0] - q[0] < tol){
+            double s = q[1] + p[1];
+            if(s > 0){
+                q[0] = (q[0]*q[1] + p[0]*p[1]) / s;
+                if(width > 2) q[2] = (q[2]*q[1] + p[2]*p[1]) / s;
+            }
+            q[1] = sqrt(q[1]*q[1] + p[1]*p[1]);
+            continue;
+        }
+        memmove(a + n*width, p, sizeof(double) * width);
+        n++;
+    }
+    return n;
+}
+
+//the value that would be v[k] were v sorted into descending order; v is reordered. Hoare quickselect.
+static double select_desc(double *v, long n, long k)
+{
+    long lo = 0, hi = n-1;
+    
+    while(lo < hi){
+        double pivot = v[lo + (hi-lo)/2], t;
+        long i = lo, j = hi;
+        while(i <= j){
+            while(v[i] > pivot) i++;
+            while(v[j] < pivot) j--;
+            if(i <= j){
+                t = v[i]; v[i] = v[j]; v[j] = t;
+                i++; j--;
+            }
+        }
+        if(k <= j) hi = j;
+        else if(k >= i) lo = i;
+        else break;
+    }
+    return v[k];
+}
+
+//keep the k loudest of num partials (width values each, amplitude second), in the order they were in. The
+//k-th loudest amplitude is found by quickselect on a copy in scratch (num doubles), so this is O(num) on average
+//rather than a sort. Returns the partials kept.
+long partials_top(double *a, long num, long width, long k, double *scratch)
+{
+    long above = 0, n = 0;
+    
+    if(k <= 0 || num <= k) return num;
+    for(long i=0;i<num;i++) scratch[i] = a[i*width+1];
+    double floor = select_desc(scratch, num, k-1);
+    for(long i=0;i<num;i++) above += a[i*width+1] > floor;
+    long ties = k - above;      //of those exactly at the floor, the first ones make up the count
+    for(long i=0;i<num;i++){
+        double v = a[i*width+1];
+        if(v > floor || (v == floor && ties-- > 0)){
+            memmove(a + n*width, a + i*width, sizeof(double) * width);
+            n++;
+        }
+    }
+    return n;
+}
+
+//largest |tab[i*nc]| for i in 0..n-1
+float abs_max_scalar(const float *tab, long n, long nc)
+{
+    float m = 0, t;
+    
+    for(long i=0;i<n;i++){
+        t = ABS(tab[i*nc]);
+        m = t > m ? t : m;
+    }
+    return m;
+}
+
+#ifdef QRM_HAVE_AVX2
+//sixteen samples per step: clear the sign bits, keep a running max in two registers
+__attribute__((target("avx2")))
+float abs_max_avx2(const float *tab, long n)
+{
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 m0 = _mm256_setzero_ps();
+    __m256 m1 = _mm256_setzero_ps();
+    float lanes[8], m = 0;
+    long i = 0;
+    
+    for(;i+16<=n;i+=16){
+        m0 = _mm256_max_ps(m0, _mm256_andnot_ps(sign, _mm256_loadu_ps(tab + i)));
+        m1 = _mm256_max_ps(m1, _mm256_andnot_ps(sign, _mm256_loadu_ps(tab + i + 8)));
+    }
+    _mm256_storeu_ps(lanes, _mm256_max_ps(m0, m1));
+    for(int k=0;k<8;k++) m = MAX(m, lanes[k]);
+    return MAX(m, abs_max_scalar(tab + i, n - i, 1));
+}
+#endif
+
+#ifdef QRM_HAVE_NEON
+float abs_max_neon(const float *tab, long n)
+{
+    float32x4_t m0 = vdupq_n_f32(0);
+    float32x4_t m1 = vdupq_n_f32(0);
+    long i = 0;
+    
+    for(;i+8<=n;i+=8){
+        m0 = vmaxq_f32(m0, vabsq_f32(vld1q_f32(tab + i)));
+        m1 = vmaxq_f32(m1, vabsq_f32(vld1q_f32(tab + i + 4)));
+    }
+    return MAX(vmaxvq_f32(vmaxq_f32(m0, m1)), abs_max_scalar(tab + i, n - i, 1));
+}
+#endif
+
+//interleaved channels are strided, so only a mono buffer~ (or a live region) gets the vector kernel
+float qrm_abs_max(const float *tab, long n, long nc)
+{
+    if(nc == 1)
+        return abs_max(tab, n);
+    return abs_max_scalar(tab, n, nc);
+}
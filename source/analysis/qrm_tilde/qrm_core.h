@@ -0,0 +1,80 @@
+//
+//  qrm_core.h
+//  qrm_tilde
+//  Analysis kernels shared by qrm~ and anything else that wants them without Max; see qrm_core.c
+//
+
+#ifndef qrm_core_h
+#define qrm_core_h
+
+//vector kernels for the spectrum pass; picked at runtime on x86, always available on arm64
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QRM_HAVE_AVX2 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define QRM_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define QRM_MAX_SLICES 64
+#define EPSILON 0.0001
+#define QRM_PEAK_BLOCK 256         //bins tested per pass of the vectorized local maximum test
+#define QRM_HALFBAND_TAPS 8        //nonzero taps either side of the centre of the decimation lowpass
+
+//the Max SDK has these already; standalone builds do not
+#ifndef PI
+#define PI 3.14159265358979323846
+#endif
+#ifndef TWOPI
+#define TWOPI 6.28318530717958647692
+#endif
+#ifndef MIN
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
+#ifndef ABS
+#define ABS(a) ((a)<0?-(a):(a))
+#endif
+
+void qrm_core_init(void);
+void hann_fill(double *w, float *wf, long n);
+double frac_bin(const double *mag, long k);
+void exp_fit(long *xVals, double *yVals, long n, double* out, double wt);
+void exp_fit_batch(long *xVals, long n, const double *y, long np, double wt, double *sums, double *A, double *B);
+void goertzel_mags(double *in, long dist, long count, long n, long len, long k, double *mags, long mstride);
+void goertzel_mags_f(float *in, long dist, long count, long n, long len, long k, double *mags, long mstride);
+void sdft_track(const float *in, long count, long hop, long n, long len, const long *k, long np, double *mags, double *state);
+void halfband_decimate(const double *in, long n, double *out);
+void halfband_decimate_f(const float *in, long n, float *out);
+void spectrum_mags_scalar(const double *outs, long nbins, double *mag, double *sum, double *max);
+void spectrum_mags_f_scalar(const float *outs, long nbins, float *mag, double *sum, double *max);
+#ifdef QRM_HAVE_AVX2
+void spectrum_mags_avx2(const double *outs, long nbins, double *mag, double *sum, double *max);
+void spectrum_mags_f_avx2(const float *outs, long nbins, float *mag, double *sum, double *max);
+#endif
+#ifdef QRM_HAVE_NEON
+void spectrum_mags_neon(const double *outs, long nbins, double *mag, double *sum, double *max);
+void spectrum_mags_f_neon(const float *outs, long nbins, float *mag, double *sum, double *max);
+#endif
+double peak_floor(double max_peak, double thresh);
+long find_peaks(const double *mag, long nbins, double floor, long *peaks, long max_peaks);
+long find_peaks_f(const float *mag, long nbins, double floor, long *peaks, long max_peaks);
+void peak_mags_widen(const float *fmag, const long *peaks, long num_peaks, double *mag);
+long partials_merge(double *a, long num, long width, double tol);
+long partials_top(double *a, long num, long width, long k, double *scratch);
+float abs_max_scalar(const float *tab, long n, long nc);
+#ifdef QRM_HAVE_AVX2
+float abs_max_avx2(const float *tab, long n);
+#endif
+#ifdef QRM_HAVE_NEON
+float abs_max_neon(const float *tab, long n);
+#endif
+float qrm_abs_max(const float *tab, long n, long nc);
+
+//set to the best kernels for this cpu by qrm_core_init
+extern void (*spectrum_mags)(const double *outs, long nbins, double *mag, double *sum, double *max);
+extern void (*spectrum_mags_f)(const float *outs, long nbins, float *mag, double *sum, double *max);
+
+#endif /* qrm_core_h */
@@ -48,26 +48,345 @@ University of California, Berkeley.
 #include "ext_common.h" // contains CLAMP macro
 #include "z_dsp.h"
 #include "ext_buffer.h"
+#include "ext_systhread.h"
 #include "fftw3.h"
 #include "time.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#ifdef WIN_VERSION
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "qrm_core.h"
 
-#define NUMSLICES 5
-#define EPSILON 0.0001
+
+#define NUMSLICES 5             //default number of analysis points for the decay fit
+#define QRM_MIN_SLICES 3
+#define QRM_FIT_BLOCK 256       //peaks gathered and fitted together; keeps the slices x peaks block in cache
+#define QRM_SPARSE_PEAKS_PER_LOG2 0.75     //auto decay_eval: Goertzel beats the slice ffts below about this many peaks per log2(fft_size),
+                                            //with windows as long as the fft
+#define QRM_QUEUE_SIZE 64       //pending requests the async worker will hold before refusing new ones
+#define QRM_MAX_FFT_SIZE 65536
+#define QRM_LIVE_MAX_REGION 2000.0  //ms; bounds the ring buffer, and so the latency, of live mode
+#define QRM_LIVE_SLOTS 16           //onsets the audio thread can hand over before the main thread picks them up
+#define QRM_ONSET_RATIO 2.0         //fast envelope over slow envelope that counts as an attack (about 6 dB)
+#define QRM_ONSET_FAST 0.002        //s, envelope follower time constants
+#define QRM_ONSET_SLOW 0.1
+#define QRM_ONSET_PREROLL 64        //samples kept ahead of the detected onset, so the attack itself is in the region
+#define QRM_ONSET_HOLD 0.05         //s, shortest gap between two onsets found by analyze_all
+#define QRM_INDEX_BLOCK 4096        //frames per change-detection hash in the onset index
+#define QRM_CACHE_BUCKETS 256       //hash buckets of the model cache
+#define QRM_MAX_CHANNELS 64         //channels one multi-channel request can cover
+#define QRM_STATS_WINDOW 512        //most recent timings kept per stage for the stats message
+#define QRM_MAX_LIST_ATOMS 32767   //outlet_list takes a short count
+#define QRM_ENV_BLOCK 64            //samples per block at the bottom of the envelope pyramid
+#define QRM_ENV_FANOUT 16           //blocks of one level per block of the next
+#define QRM_ENV_LEVELS 6
+#define QRM_MAX_BANDS 4             //multi-resolution bands, so at most QRM_MAX_BANDS-1 crossovers
+#define QRM_MIN_BAND_FFT 256        //shortest transform a band above the first may have
+#define QRM_TRACK_POINTS 64         //decay_eval track: envelope points per partial, spread over the region
+#define QRM_PREFETCH_SLOTS 16       //prefetched int frames kept
+#define QRM_PREFETCH_DEPTH 8        //most cursors prefetched ahead (and half as many behind) of an int request
+#define QRM_BANK_MAGIC "QRMB"
+#define QRM_BANK_VERSION 1
+#define QRM_BANK_ALIGNMENT 64       //model bank columns start on cache lines
+#define QRM_BANK_ALIGN(n) (((n) + QRM_BANK_ALIGNMENT - 1) & ~(uint64_t)(QRM_BANK_ALIGNMENT - 1))
+
+//where the analysis points sit between the attack and the end of the region
+enum {
+    QRM_SPACING_UNIFORM = 0,
+    QRM_SPACING_LOG             //bunched up near the attack, where the decay is fastest
+};
+
+//request kinds
+enum {
+    QRM_REQ_INT = 0,            //sinusoidal (frequency, amplitude) frame at a cursor
+    QRM_REQ_LIST,               //resonant (frequency, amplitude, decay) model over a region
+    QRM_REQ_LIVE,               //resonant model over a region of the live input ring
+    QRM_REQ_CHANNELS,           //resonant models of several channels over a region, and their merge
+    QRM_REQ_KINDS
+};
+
+//timed stages of an analysis. They are not exclusive: lock is how long the samples were held, which overlaps
+//attack and window, and total covers everything but output, which happens later on the main thread.
+enum {
+    QRM_STAGE_LOCK = 0,         //buffer~ locked
+    QRM_STAGE_ATTACK,           //findMaxInBuffer
+    QRM_STAGE_WINDOW,           //copying and windowing the samples
+    QRM_STAGE_FFT,
+    QRM_STAGE_SPECTRUM,         //magnitudes
+    QRM_STAGE_PEAKS,
+    QRM_STAGE_FIT,              //slice magnitudes at the peaks and the decay fit
+    QRM_STAGE_REFINE,           //fractional bins and the result list
+    QRM_STAGE_OUTPUT,
+    QRM_STAGE_TOTAL,
+    QRM_STAGES
+};
+static const char *qrm_stage_names[QRM_STAGES] = {"lock", "attack", "window", "fft", "spectrum", "peaks", "fit", "refine", "output", "total"};
+
+//what the windows, ffts, spectra and peak picking run in. The decay fit and fractional bins stay in double
+//either way: the fit's sums of x^2*y over region-length x run far past float's 24 bits.
+enum {
+    QRM_PRECISION_DOUBLE = 0,
+    QRM_PRECISION_SINGLE        //fftwf, and float spectra: half the bytes, twice the vector width
+};
+
+//how slices 1..num_slices-1 are evaluated at the peak bins of slice 0
+enum {
+    QRM_DECAY_AUTO = 0,         //pick sparse or fft by peak count
+    QRM_DECAY_FFT,              //full ffts of every slice
+    QRM_DECAY_SPARSE,           //Goertzel at the peak bins only
+    QRM_DECAY_TRACK             //follow each peak through the whole region with a sliding dft instead of the slices
+};
+
+//shared fftw plan, reference counted across every qrm~ instance in the process.
+//plans are keyed by transform size, precision and layout (number of transforms, input and output distance) and are
+//executed with the new-array interface, so any instance with identically laid out fftw_malloc'd arrays can use them.
+typedef struct _qrm_plan {
+    long size;
+    char precision;             //'d' for fftw (double), 'f' for fftwf (single)
+    long howmany;
+    long idist;                 //samples between consecutive inputs
+    long odist;                 //complex bins between consecutive outputs
+    long refcount;
+    fftw_plan p;                //precision 'd'
+    fftwf_plan pf;              //precision 'f'
+    struct _qrm_plan *next;
+}t_qrm_plan;
 
 //struct to contain analysis window
+//in and outs point into the work buffer's contiguous slice_in/slice_outs blocks, which are transformed together by slice_plan
 typedef struct _Slice {
     long index_in_buffer;
-    fftw_plan p;
-    double *in;
-    double *outs;
+    double *in;                 //fft_size samples at slice_in + i*slice_idist; past win_len they are zero
+    double *outs;               //interleaved complex bins at slice_outs + i*2*slice_odist
+    float *fin;                 //single precision: the same, in fslice_in and fslice_outs
+    float *fouts;
     double *mag_spec;
-    double *phase_spec;
     double sum;
     double max_peak;
     int num_peaks;
 //    long *peaks;
 }t_Slice;
 
+//everything a cached result depends on. Zeroed before it is filled in, so keys compare with memcmp.
+typedef struct _qrm_cache_key {
+    t_symbol *buffer;           //NULL for requests that are never cached
+    long chan;
+    long kind;
+    long c1;
+    long c2;
+    long fft_size;
+    long win_len;
+    double thresh;
+    long num_slices;
+    long slice_spacing;
+    long decay_eval;
+    long precision;
+    long num_bands;
+    double band_cuts[QRM_MAX_BANDS-1];  //the ones in use; the rest stay zero
+    long max_partials;
+    double partial_tol;
+}t_qrm_cache_key;
+
+//one cached result; entries are in a hash bucket chain and in the LRU list at the same time
+typedef struct _qrm_cache_entry {
+    t_qrm_cache_key key;
+    unsigned long long hash;
+    double *data;               //num pairs (int) or triples (list)
+    long num;
+    long attack;
+    float max_val;
+    long bytes;                 //what this entry counts against cache_size
+    struct _qrm_cache_entry *prev;      //LRU order, most recently used first
+    struct _qrm_cache_entry *next;
+    struct _qrm_cache_entry *chain;     //next in the same bucket
+}t_qrm_cache_entry;
+
+//an int frame analyzed ahead of time by prefetch; key.c1 is its cursor
+typedef struct _qrm_prefetch {
+    t_qrm_cache_key key;
+    double *data;               //num (frequency, amplitude) pairs; NULL while the slot is empty
+    long num;
+    long alloc;                 //doubles data has room for
+}t_qrm_prefetch;
+
+//one analysis request, as received by qrm_int or qrm_list
+typedef struct _qrm_request {
+    long kind;                  //QRM_REQ_INT, QRM_REQ_LIST, ...
+    long id;                    //tag sent out the id outlet ahead of the result
+    long seq;                   //arrival order, so results are delivered in the order they were asked for
+    long c1;                    //cursor (int) or region start (list)
+    long c2;                    //region end (list)
+    long long origin;           //live: ring position of sample 0 of the region
+    t_qrm_cache_key key;        //settings at the time of the request, for the model cache
+}t_qrm_request;
+
+//region after an onset, handed from the audio thread to the main thread
+typedef struct _qrm_onset {
+    long long start;            //ring position (samples since dsp started)
+    long len;                   //region length in samples; the window after it is in the ring too
+}t_qrm_onset;
+
+//one onset of the whole-buffer index built by analyze_all
+typedef struct _qrm_index_entry {
+    long start;                 //onset, less the preroll
+    long end;                   //region end: the next onset, or the last frame with an fft's worth after it
+    long attack;                //loudest sample in the region
+    float peak;                 //its level
+    double *model;              //(frequency, amplitude, decay) triples, NULL if the analysis failed
+    long num;
+}t_qrm_index_entry;
+
+//model bank file, as written by write and mapped by read: this header, count entries, then the partials of every
+//model as three float columns (frequency, amplitude, decay), each on a QRM_BANK_ALIGNMENT boundary. Offsets are
+//bytes from the start of the file. Native byte order; the layout only changes with QRM_BANK_VERSION.
+typedef struct _qrm_bank_header {
+    char magic[4];              //QRM_BANK_MAGIC
+    uint32_t version;
+    uint32_t entry_size;        //sizeof(t_qrm_bank_entry)
+    uint32_t count;             //models
+    uint64_t partials;          //length of each column
+    uint64_t size;              //of the whole file
+    uint64_t entries;
+    uint64_t freqs;
+    uint64_t amps;
+    uint64_t decays;
+    double sr;                  //of the buffer~ the models came from
+}t_qrm_bank_header;
+
+//one model of a bank: its source region and the analysis settings it was made with
+typedef struct _qrm_bank_entry {
+    int64_t start;
+    int64_t end;
+    int64_t attack;
+    uint64_t first;             //its first partial in the columns
+    uint32_t num;               //partials
+    float peak;                 //attack level
+    int32_t fft_size;
+    int32_t win_len;
+    int32_t slices;
+    int32_t bands;
+    int32_t precision;
+    int32_t chan;
+    int32_t max_partials;
+    float thresh;
+    float partial_tol;
+    uint32_t reserved;
+}t_qrm_bank_entry;
+
+//a mapped model bank; hdr is NULL while none is open
+typedef struct _qrm_bank {
+    void *base;
+    size_t size;
+#ifdef WIN_VERSION
+    HANDLE file;
+    HANDLE map;
+#endif
+    const t_qrm_bank_header *hdr;
+    const t_qrm_bank_entry *e;
+    const float *freqs;
+    const float *amps;
+    const float *decays;
+}t_qrm_bank;
+
+//per-request scratch state. Everything the pipeline writes lives here, so an analysis running on the worker
+//thread never touches what bang or the outlets are reading. The object keeps two of these and alternates.
+typedef struct _qrm_work {
+    t_qrm_request req;          //the request this buffer is answering
+    long ready;                 //1 while holding a finished result that has not been delivered yet
+    long ok;                    //0 if the analysis failed (no buffer)
+    long served;                //1 if the result came from the index, the cache or the prefetch ring rather than analysis
+    float sr;                   //buffer sample rate at analysis time
+    long attack;                //index of the attack found by findMaxInBuffer (list requests)
+    float max_val;              //amplitude of that attack
+    double *in;                 //sinusoidal model analysis input
+    double *outs;               //sinusoidal model analysis outputs
+    double *mag_spec;           //sinusoidal model magnitude spectrum
+    double sum;
+    double max_peak;
+    int num_peaks;
+    long *peaks;
+    double *cooked;             //(frequency, amplitude) pairs for int requests
+    struct _Slice slices[QRM_MAX_SLICES];   //an array of analysis windows for resonant model computation; num_slices are used
+    double *slice_in;           //num_slices windowed inputs, slice_idist apart
+    double *slice_outs;         //num_slices * slice_odist complex outputs, back to back
+    float *fin;                 //single precision counterparts of in, outs, slice_in and slice_outs; only the
+    float *fouts;               //set for the current precision has any room carved for it
+    float *fslice_in;
+    float *fslice_outs;
+    double *band_in;            //bands above 0 and decimated band 0: num_slices stretches of band_idist samples, each
+    float *fband_in;            //holding every such band's window of that slice; again only the current precision has room
+    float *fmag;                //single precision magnitude spectrum (of slice 0 of every band, for list requests)
+    long band_lo[QRM_MAX_BANDS];        //bins each band's peaks are picked from, lo to hi, for this analysis
+    long band_hi[QRM_MAX_BANDS];
+    long idxs[QRM_MAX_SLICES];  //list of slice indexes, relative to the first slice
+    double *fit_y;              //num_slices (or QRM_TRACK_POINTS) x QRM_FIT_BLOCK peak magnitudes, slice-major, for exp_fit_batch
+    double *fit_sums;           //5 x QRM_FIT_BLOCK scratch for exp_fit_batch
+    double* amps;               //output amplitudes
+    double* dr;                 //output decay rates
+    double* model;              //(frequency, amplitude, decay) triples for list requests
+    const t_float *track;       //decay_eval track: the region's samples from the attack on, track_len of them; 0 when
+    long track_len;             //there are none to track (channels requests), and the slices are used after all
+    t_float *track_buf;         //buffer~ requests copy them here, since the buffer~ is unlocked before peak picking
+    long track_alloc;
+    long track_idxs[QRM_TRACK_POINTS];  //envelope points, relative to the attack
+    double *track_state;        //18 x QRM_FIT_BLOCK of sliding dft state
+    t_float *live;              //live requests: the region copied out of the ring
+    long live_frames;           //samples in live
+    long live_alloc;            //capacity of live
+    char *arena;                //this buffer's own arena when it is not part of the object's (batch threads)
+    size_t arena_size;
+    double stage_us[QRM_STAGES];    //time spent in each stage of this analysis
+    unsigned stages;            //bit per stage that ran
+    double lock_t;              //when the samples were locked
+    long nans;                  //NaN amplitudes replaced in the model
+    long nch;                   //channels requests: how many channels, and which (0-based)
+    long ch[QRM_MAX_CHANNELS];
+    long ch_num[QRM_MAX_CHANNELS];  //peaks in each channel's model
+    float *deint;               //nch x num_slices x fft_size samples, channel-major; all three of these are in multi,
+    double *ch_models;          //nch x fft_size/2 triples, one channel's model after another
+    double *merge;              //as large again, for sorting every channel's triples together
+    char *multi;                //grown as needed; how many channels there are is only known once the buffer~ is locked
+    size_t multi_alloc;
+}t_qrm_work;
+
+//rolling record of one statistic: the last QRM_STATS_WINDOW values, oldest overwritten first
+typedef struct _qrm_series {
+    float v[QRM_STATS_WINDOW];
+    long count;                 //values recorded since the last reset
+}t_qrm_series;
+
+//bump allocator for carving per-size state out of an arena. With base NULL it only adds up the sizes.
+//every piece starts on a 64-byte boundary, so fftw sees the alignment it was planned with.
+typedef struct _qrm_carve {
+    char *base;
+    size_t used;
+}t_qrm_carve;
+
+//one band of a multi-resolution analysis. Band 0 is the analysis at fft_size, and without crossovers it is the
+//only one; each band above it halves the transform and the window, so its slices blur less of a fast decay.
+//With crossovers, band 0 only needs the spectrum up to the first one, so its full-length windows are decimated
+//by decim first and it transforms fft_size/decim samples, at the same bin width.
+typedef struct _qrm_band {
+    long fft_size;              //(x->fft_size >> band) / decim
+    long win_len;               //x->win_len >> band; a decimated band 0's fill its transform, the filter tails wrapping
+    long decim;                 //band 0: power of two its windows are decimated by; 1 for every other band
+    double scale;               //what a partial's magnitude in this band is, relative to band 0 undecimated
+    double lo;                  //Hz; partials from lo up to hi are taken from this band
+    double hi;                  //0 for up to Nyquist
+    long in_off;                //bands in band_in: where the window starts in each slice's stretch of it
+    long mag_off;               //where the band's slice 0 magnitudes start in the work buffer's mag_spec and fmag
+    double *window;             //win_len samples (in arena); band 0's are window_function and fwindow, x->win_len long
+    float *fwindow;
+    t_qrm_plan *p;              //undecimated band 0 shares x->p and x->decay_plan
+    t_qrm_plan *decay_plan;
+}t_qrm_band;
+
 //struct for object
 typedef struct _qrm {
     t_pxobject l_obj;
@@ -76,47 +395,193 @@ typedef struct _qrm {
     long l_chan;
     //t_buffer_ref *o_buffer_reference;
     //long o_chan;
-    double *window_function;
+    double *window_function;    //window_function, cooked, model and both work buffers are carved from arena
+    float *fwindow;             //window_function in single precision
+    char *arena;                //per-size state, one aligned block; only grows
+    size_t arena_size;
+    long footprint;             //bytes held in arena (read-only attribute)
+    t_atom *atoms;              //list output storage, QRM_MAX_LIST_ATOMS at most (in arena)
+    long num_atoms;
+    t_symbol *sink;             //buffer~ that results are written into instead of listed out; empty for lists
+    long channels[QRM_MAX_CHANNELS];    //1-based channels list requests analyze together; none for just l_chan
+    long num_channels;
+    char channels_all;          //every channel of the buffer~ instead
+    char merge;                 //after the per-channel models, output them merged into one
+    double *ch_models;          //published per-channel models of the last channels request
+    size_t ch_alloc;
+    long ch_num[QRM_MAX_CHANNELS];
+    long ch_list[QRM_MAX_CHANNELS];
+    long num_ch;                //0 unless the last list result was a channels request
+    t_qrm_series stats[QRM_STAGES];     //stage timings in microseconds, for the stats message
+    t_qrm_series stat_peaks;    //peaks found per analysis
+    long stat_nans;             //NaN amplitudes replaced since the last reset
+    t_systhread_mutex stats_mutex;      //batch threads record too
+    t_buffer_ref *sink_ref;
+    long sink_rows;             //rows the last sink write filled; -1 until the whole sink has been cleared once
     long sample_vector_size;    //length of vector we will pull from the buffer
     long cursor;                //cursor in buffer (the analysis point)
     long cursor2;               //cursor2 in buffer (the second analysis point)
-    long *analysis_points;      //an array of analysis points for determining decay rates
-    double *ap0;
-    double *ap1;
-    double *ap2;
-    double *ap3;
-    double *ap4;
     void *out;                  //outlet
 //    void *f_out;
     void *slice_out;            //dump outlet
     void *model_out;
+    void *id_out;               //request id outlet
+    void *info_out;             //stats outlet
     long fft_size;
-    fftw_plan p;                //sinusoidal fftw plan
-    double *in;                 //sinusoidal model analysis input
-    double *outs;               //sinusoidal model analysis inputs
-    double *mag_spec;           //sinusoidal model magnitude spectrum
-    double *phase_spec;         //sinusoidal model phase spectrum
+    t_qrm_plan *p;              //sinusoidal fftw plan (shared)
+    t_qrm_plan *slice_plan;     //one batched r2c plan covering all num_slices windows (shared); decay_eval fft, one band
+    t_qrm_plan *decay_plan;     //batched r2c plan covering slices 1..num_slices-1 only (shared)
+    long num_slices;            //analysis points for the decay fit
+    long slice_spacing;         //QRM_SPACING_UNIFORM or QRM_SPACING_LOG
+    long window_size;           //samples analyzed per frame, zero-padded up to fft_size; 0 for fft_size
+    long win_len;               //what that comes to: window_size, at most fft_size
+    long slice_idist;           //distance in samples between slice inputs (fft_size, padded to keep alignment)
+    long slice_odist;           //distance in complex bins between slice outputs (fft_size/2+1, padded to keep alignment)
+    double band_cuts[QRM_MAX_BANDS-1];  //crossovers of the bands attribute, Hz, ascending
+    long num_cuts;
+    t_qrm_band band[QRM_MAX_BANDS];     //num_bands of them in use, band 0 always
+    long num_bands;
+    long band_idist;            //samples per slice in band_in; 0 with a single band
+    long band_bins;             //every band's slice 0 spectrum, end to end
+    long decay_eval;            //QRM_DECAY_AUTO, QRM_DECAY_FFT, QRM_DECAY_SPARSE or QRM_DECAY_TRACK
+    long precision;             //QRM_PRECISION_DOUBLE or QRM_PRECISION_SINGLE
+    long max_partials;          //loudest partials kept per result; 0 for all of them
+    double partial_tol;         //Hz; partials closer than this are merged into one first. 0 for none
     double thresh;
-    double sum;
-    double max_peak;
-    int num_peaks;
-    long *peaks;
     float sr;
-    double *cooked;
     float* tab;                 //variable for buffer access
     t_buffer_obj* buffer;       //pointer to buffer
-    long region_max_ind;        //index for max functions
-    float max_val;              //value for max functions
-    struct _Slice slices[NUMSLICES];    //an array of analysis windows for resonant model computation
-    long* idxs;                 //list of slice indexes
-    double* tempY;              //array for amplitude values in exponential fitting
-    double* tempAB;             //array to hold result of exponential fitting
-    double* amps;               //output amplitudes
-    double* dr;                 //output decay rates
-    double* model;              //output model
+    long region_max_ind;        //attack index of the last delivered model
+    float max_val;              //attack amplitude of the last delivered model
+    t_qrm_work work[2];         //double-buffered scratch state for analyses in flight
+    double *cooked;             //last delivered (frequency, amplitude) frame
+    long num_cooked;            //number of pairs in cooked
+    double* model;              //last delivered model
+    long num_model;             //number of triples in model
+    t_qrm_request last_req;     //request that produced the last delivered result
+    long next_id;               //id given to requests that do not carry their own
+    long next_seq;
+    char async;                 //1 to run analyses on the worker thread
+    char coalesce;              //1 for latest-wins: a new request replaces queued and running ones of the same kind
+    long latest_seq[QRM_REQ_KINDS];     //seq of the newest request of each kind
+    long dropped;               //requests discarded or abandoned by coalescing
+    t_systhread worker;
+    long worker_quit;
+    t_systhread_mutex analysis_mutex;   //held while a work buffer is being written or fft_size is changing
+    t_systhread_mutex queue_mutex;      //guards queue and the work buffers' ready flags
+    t_systhread_cond queue_cond;        //signalled when a request is queued or a work buffer is freed
+    t_qrm_request queue[QRM_QUEUE_SIZE];
+    long queue_head;
+    long queue_count;
+    void *deliver_qelem;        //brings finished async results back to the main thread
+    struct _qrm_batch *batch_head;    //batches waiting for the worker, oldest first; guarded by queue_mutex
+    struct _qrm_batch *batch_tail;
+    struct _qrm_batch *done_head;     //batches the worker has finished, waiting for the main thread
+    struct _qrm_batch *done_tail;
+    t_symbol *wisdom;           //mirrors the process-wide wisdom file (attribute storage)
+    t_symbol *planner;          //mirrors the process-wide planning rigor (attribute storage)
+    char live;                  //1 to analyze the signal input after each onset instead of indexing the buffer
+    double live_region;         //ms analyzed after each onset
+    double live_thresh;         //dB; quieter onsets are ignored
+    double live_sr;             //dsp sample rate
+    long live_region_samps;     //the above, converted for the audio thread
+    double live_floor;
+    double env_fast_coef;
+    double env_slow_coef;
+    float *ring;                //live input, written only by the audio thread
+    long ring_size;             //power of two
+    long long ring_pos;         //audio thread's write position
+    atomic_llong ring_written;  //ring_pos as last published to the other threads
+    double env_fast;            //onset detector state, audio thread only
+    double env_slow;
+    long long live_hold;        //no new onset before this position
+    long long live_pending;     //start of a region still being recorded, or -1
+    long live_pending_len;
+    t_qrm_onset live_onsets[QRM_LIVE_SLOTS];    //single producer (audio thread), single consumer (main thread)
+    atomic_long live_head;
+    atomic_long live_tail;
+    void *live_qelem;
+    long batch_threads;         //threads used by batch; 0 for one per core
+    t_qrm_index_entry *index;   //onsets of the whole buffer, in order; NULL until analyze_all
+    long index_count;
+    unsigned long long *index_hash;     //per QRM_INDEX_BLOCK frames, as of the last build
+    long index_blocks;
+    long index_frames;          //buffer layout the index was built with
+    long index_nc;
+    t_qrm_cache_key index_key;  //buffer~ and analysis settings it was built with; chan is the channel analyzed
+    void *index_qelem;          //rebuilds the index after the buffer changes
+    t_systhread index_thread;   //builds run here, never on the main thread
+    char index_busy;            //a build is running; guarded by queue_mutex, like index_again
+    char index_again;           //something changed while it ran: build again once it is done
+    long index_gen;             //bumped by clear_index, so a build that was running then is not published
+    t_qrm_bank bank;            //model bank mapped by read
+    long bank_count;
+    t_symbol *buffer_name;      //set by qrm_set
+    long cache_size;            //KB of results the model cache may hold; 0 turns it off
+    long cache_bytes;
+    long cache_hits;
+    long cache_misses;
+    t_qrm_cache_entry *cache_buckets[QRM_CACHE_BUCKETS];
+    t_systhread_mutex cache_mutex;      //guards the cache: served and cleared on the main thread, filled wherever results are published
+    t_qrm_cache_entry *cache_head;      //most recently used
+    t_qrm_cache_entry *cache_tail;      //next to be evicted
+    long layout_gen;            //bumped whenever the arena is carved again, so pf_work knows to follow
+    long prefetch;              //cursors analyzed ahead of each int request while idle; 0 for none
+    long prefetch_stride;       //samples between them; 0 for a quarter of fft_size
+    long prefetch_tol;          //an int request this close to a prefetched cursor is answered with its frame
+    long prefetch_hits;
+    t_qrm_prefetch pf[QRM_PREFETCH_SLOTS];  //ring of prefetched frames, oldest overwritten first (queue_mutex)
+    long pf_head;
+    long pf_pos[QRM_PREFETCH_DEPTH + QRM_PREFETCH_DEPTH/2]; //the current plan: cursors still to analyze, nearest first
+    long pf_todo;
+    long pf_next;
+    long pf_gen;                //bumped by every plan, so analyses for an older one give up
+    long pf_last;               //cursor of the previous int request, for the scrub direction
+    t_qrm_work pf_work;         //its own scratch, so prefetching never holds a work buffer a request needs
+    long pf_layout;             //layout_gen pf_work was carved for
+    void *pf_qelem;             //synchronous mode: prefetches a cursor at a time from the main thread
+    char envelope;              //1 to find attacks with the envelope pyramid
+    float *env[QRM_ENV_LEVELS]; //peak |sample| of each block, QRM_ENV_BLOCK * QRM_ENV_FANOUT^level samples long
+    long env_count[QRM_ENV_LEVELS];
+    long env_levels;            //0 while there is no pyramid
+    long env_frames;            //buffer layout the pyramid was built for
+    long env_nc;
+    long env_chan;
+    char env_dirty;             //buffer modified since the pyramid was built
+    t_systhread_mutex env_mutex;
     
 } t_qrm;
 
+//one batch message in progress: regions in, per-region results out
+//the per-channel part of a channels result in a batch: every channel's model, one after another
+typedef struct _qrm_batch_channels {
+    long nch;
+    long ch[QRM_MAX_CHANNELS];
+    long num[QRM_MAX_CHANNELS];
+    double *models;             //in the same allocation, right after this
+}t_qrm_batch_channels;
+
+typedef struct _qrm_batch {
+    t_qrm *x;
+    t_qrm_request *reqs;
+    long count;
+    atomic_long next;           //next region to hand out
+    double **models;
+    long *num;
+    long *attack;
+    float *max_val;
+    char *ok;
+    t_qrm_batch_channels **chans;   //NULL unless the region was a channels request
+    long seq;                   //when it was submitted, in the same order as the request queue
+    struct _qrm_batch *link;    //in the worker's pending or finished list
+}t_qrm_batch;
+
+typedef struct _qrm_batch_thread {
+    t_qrm_batch *b;
+    t_qrm_work w;               //this thread's scratch
+    t_systhread th;
+}t_qrm_batch_thread;
+
 
 
 //prototypes
@@ -129,6 +594,13 @@ void qrm_getvsize(t_qrm *x);
 void qrm_set_fft_size(t_qrm *x, long n);
 t_max_err qrm_attr_set_fft_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
 t_max_err qrm_attr_get_fft_size(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
+int qrm_fft_size_ok(long n);
+void qrm_win_update(t_qrm *x);
+t_max_err qrm_attr_set_window_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+void qrm_bands_layout(t_qrm *x);
+void qrm_band_plans_release(t_qrm *x);
+t_max_err qrm_attr_set_bands(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_get_bands(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
 void *qrm_new(t_symbol *s, long argc, t_atom* argv);
 void qrm_free(t_qrm *x);
 t_max_err qrm_notify(t_qrm *x, t_symbol *s, t_symbol *msg, void *sender, void *data);
@@ -138,17 +610,136 @@ void qrm_dblclick(t_qrm *x);
 void qrm_set_thresh(t_qrm *x, double n);
 t_max_err qrm_attr_set_thresh(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
 t_max_err qrm_attr_get_thresh(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
+t_max_err qrm_attr_set_async(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_coalesce(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+int qrm_stale(t_qrm *x, t_qrm_work *w);
 void qrm_bang(t_qrm *x);
 void qrm_list_out(t_qrm *x, double* a, long l, void* outlet);
+void qrm_result_out(t_qrm *x, double *a, long num, long width, void *outlet);
+long qrm_sink_write(t_qrm *x, double *a, long num, long width);
+t_max_err qrm_attr_set_sink(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
 void qrm_list(t_qrm *x, t_symbol *msg, long argc, t_atom *argv);
-void exp_fit(long *xVals, double *yVals, long n, double* out, double wt);
-void hann_window(t_qrm *x, double *a);
+void qrm_submit(t_qrm *x, t_qrm_request *r);
+int qrm_region_clamp(t_qrm *x, long *c1, long *c2, long buffer_len);
+void qrm_batch(t_qrm *x, t_symbol *msg, long argc, t_atom *argv);
+void qrm_batch_init(t_qrm_batch *b, t_qrm *x, long count);
+void qrm_batch_analyze(t_qrm_batch *b);
+void qrm_batch_free(t_qrm_batch *b);
+void qrm_batch_out(t_qrm *x, t_qrm_batch *b);
+void qrm_batch_run(t_qrm_batch_thread *t);
+void *qrm_batch_thread(t_qrm_batch_thread *t);
+long qrm_cpu_count(void);
+int qrm_analyze(t_qrm *x, t_qrm_work *w);
+int qrm_analyze_int(t_qrm *x, t_qrm_work *w);
+int qrm_analyze_list(t_qrm *x, t_qrm_work *w);
+void qrm_publish(t_qrm *x, t_qrm_work *w);
+void qrm_output(t_qrm *x);
+void qrm_deliver(t_qrm *x);
+void qrm_analysis_lock(t_qrm *x, long idle);
+t_qrm_work *qrm_work_idle(t_qrm *x);
+void *qrm_worker(t_qrm *x);
+void qrm_worker_start(t_qrm *x);
+void qrm_worker_stop(t_qrm *x);
+long qrm_slice_offset(t_qrm *x, long span, long i);
+void qrm_set_num_slices(t_qrm *x, long n);
+t_max_err qrm_attr_set_num_slices(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_decay_eval(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_slice_spacing(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_max_partials(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_partial_tol(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+void qrm_plans_update(t_qrm *x);
 void hann_window_gen(t_qrm *x);
-void findMaxInBuffer(t_qrm* x);
+int findMaxInBuffer(t_qrm* x, t_qrm_work *w);
+void qrm_env_build(t_qrm *x, const t_float *tab, long frames, long nc, long chan);
+void qrm_env_free(t_qrm *x);
+long qrm_env_level(t_qrm *x, long p, long c2, long *bs);
+float qrm_env_max(t_qrm *x, const t_float *tab, long nc, long chan, long c1, long c2);
+long qrm_env_find(t_qrm *x, const t_float *tab, long nc, long chan, long c1, long c2, float m);
+t_float *qrm_samples_lock(t_qrm *x, t_qrm_work *w, long *frames, long *nc, long *chan);
+void qrm_samples_unlock(t_qrm *x, t_qrm_work *w);
+void qrm_live_perform(t_qrm *x, double *in, double *out, long n);
+int qrm_onset_detect(double a, double *fast, double *slow, double fast_coef, double slow_coef, double floor);
+void qrm_analyze_all(t_qrm *x);
+void qrm_clear_index(t_qrm *x);
+void qrm_index_start(t_qrm *x);
+void *qrm_index_thread(t_qrm *x);
+void qrm_index_build(t_qrm *x);
+void qrm_index_free(t_qrm *x);
+int qrm_index_matches(t_qrm *x, const t_qrm_cache_key *k);
+void qrm_write(t_qrm *x, t_symbol *path);
+void qrm_read(t_qrm *x, t_symbol *path);
+void qrm_recall(t_qrm *x, long n);
+int qrm_bank_path(t_symbol *name, int write, char *out);
+void qrm_bank_unmap(t_qrm_bank *b);
+int qrm_index_serve(t_qrm *x, t_qrm_work *w);
+unsigned long long qrm_block_hash(const t_float *tab, long start, long n, long nc, long chan);
+void qrm_cache_key(t_qrm *x, t_qrm_request *r);
+unsigned long long qrm_cache_hash(const t_qrm_cache_key *k);
+int qrm_cache_serve(t_qrm *x, t_qrm_work *w);
+void qrm_cache_insert(t_qrm *x, t_qrm_work *w);
+void qrm_cache_unlink(t_qrm *x, t_qrm_cache_entry *e);
+void qrm_cache_trim(t_qrm *x, long bytes);
+void qrm_cache_clear(t_qrm *x);
+t_max_err qrm_attr_set_cache_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+int qrm_prefetch_serve(t_qrm *x, t_qrm_work *w);
+void qrm_prefetch_plan(t_qrm *x, long n);
+int qrm_prefetch_step(t_qrm *x);
+void qrm_prefetch_idle(t_qrm *x);
+void qrm_prefetch_clear(t_qrm *x);
+void qrm_live_drain(t_qrm *x);
+int qrm_live_fetch(t_qrm *x, t_qrm_work *w);
+void qrm_live_ring_alloc(t_qrm *x, double sr);
+void qrm_live_update(t_qrm *x);
+t_max_err qrm_attr_set_live(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_live_region(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_set_live_thresh(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+void qrm_work_alloc(t_qrm *x, t_qrm_work *w);
+void qrm_work_free(t_qrm_work *w);
+void *qrm_carve(t_qrm_carve *c, size_t bytes);
+void qrm_work_carve(t_qrm *x, t_qrm_work *w, t_qrm_carve *c);
+void qrm_arena_carve(t_qrm *x, t_qrm_carve *c);
+void qrm_arena_update(t_qrm *x);
+t_qrm_plan *qrm_plan_acquire(long size, long howmany, long idist, long odist, char precision);
+t_max_err qrm_attr_set_precision(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+double qrm_now(void);
+void qrm_lap(t_qrm_work *w, long stage, double *t);
+void qrm_series_push(t_qrm_series *s, double v);
+void qrm_series_summary(t_qrm_series *s, t_atom *a);
+void qrm_stats_record(t_qrm *x, t_qrm_work *w);
+void qrm_stats(t_qrm *x, t_symbol *s);
+void qrm_slice_positions(t_qrm *x, t_qrm_work *w);
+void qrm_slices_window(t_qrm *x, t_qrm_work *w, const t_float **src, long stride);
+int qrm_model_fit(t_qrm *x, t_qrm_work *w);
+int qrm_track_fetch(t_qrm *x, t_qrm_work *w, const t_float *tab, long frames, long nc, long chan);
+void qrm_band_decimate(t_qrm *x, t_qrm_work *w);
+double qrm_band_spectrum(t_qrm *x, t_qrm_work *w, int band, double lo, double hi);
+long qrm_band_fit(t_qrm *x, t_qrm_work *w, int band, double ref, double *model, long max);
+long qrm_band_dedupe(const double *prev, long np, double *model, long m, double bw);
+long qrm_partials_limit(t_qrm *x, t_qrm_work *w, double *a, long num, long width);
+int qrm_analyze_channels(t_qrm *x, t_qrm_work *w);
+long qrm_channel_list(t_qrm *x, long nc, long *ch);
+long qrm_models_merge(const double *models, const long *num, long nch, long stride, double tol, double *scratch, double *out, long max);
+void qrm_channels_out(t_qrm *x);
+t_max_err qrm_attr_set_channels(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_get_channels(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
+void qrm_plan_release(t_qrm_plan *plan);
+void qrm_wisdom_default_path(char *path, size_t len);
+void qrm_wisdom_import(void);
+void qrm_wisdom_export(void);
+t_max_err qrm_attr_set_wisdom(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_get_wisdom(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
+t_max_err qrm_attr_set_planner(t_qrm *x, t_object *attr, long *argc, t_atom *argv);
+t_max_err qrm_attr_get_planner(t_qrm *x, t_object *attr, long *argc, t_atom **argv);
 
 //class
 static t_class *qrm_class;
 
+//process-wide plan registry and wisdom state
+static t_qrm_plan *qrm_plans = NULL;
+static t_systhread_mutex qrm_plans_mutex = NULL;
+static unsigned qrm_planner_flags = FFTW_MEASURE;
+static char qrm_wisdom_path[MAX_PATH_CHARS];
+
 C74_EXPORT void ext_main(void *r)
 {
     t_class *c = class_new("qrm~", (method)qrm_new, (method)qrm_free, sizeof(t_qrm), 0L, A_GIMME, 0);
@@ -165,6 +756,14 @@ C74_EXPORT void ext_main(void *r)
     class_addmethod(c, (method)qrm_set_thresh, "set_thresh", A_FLOAT, 0);
     class_addmethod(c, (method)qrm_bang, "bang", A_CANT, 0);
     class_addmethod(c, (method)qrm_list, "list", A_CANT, 0);
+    class_addmethod(c, (method)qrm_batch, "batch", A_GIMME, 0);
+    class_addmethod(c, (method)qrm_analyze_all, "analyze_all", 0);
+    class_addmethod(c, (method)qrm_clear_index, "clear_index", 0);
+    class_addmethod(c, (method)qrm_cache_clear, "cache_clear", 0);
+    class_addmethod(c, (method)qrm_stats, "stats", A_DEFSYM, 0);
+    class_addmethod(c, (method)qrm_write, "write", A_DEFSYM, 0);
+    class_addmethod(c, (method)qrm_read, "read", A_DEFSYM, 0);
+    class_addmethod(c, (method)qrm_recall, "recall", A_LONG, 0);
 
     CLASS_ATTR_DOUBLE(c, "thresh", 0, t_qrm, thresh);
     CLASS_ATTR_FILTER_MAX(c, "thresh", 0.0);
@@ -179,7 +778,141 @@ C74_EXPORT void ext_main(void *r)
     CLASS_ATTR_LABEL(c, "fft_size", 0, "FFT Size");
     CLASS_ATTR_ALIAS(c, "fft_size", "FFT_Size");
     CLASS_ATTR_ACCESSORS(c, "fft_size", qrm_attr_get_fft_size, qrm_attr_set_fft_size);
+    
+    CLASS_ATTR_LONG(c, "window_size", 0, t_qrm, window_size);
+    CLASS_ATTR_LABEL(c, "window_size", 0, "Window Size (0 for FFT Size)");
+    CLASS_ATTR_ACCESSORS(c, "window_size", NULL, qrm_attr_set_window_size);
+    
+    CLASS_ATTR_DOUBLE_VARSIZE(c, "bands", 0, t_qrm, band_cuts, num_cuts, QRM_MAX_BANDS-1);
+    CLASS_ATTR_LABEL(c, "bands", 0, "Band Crossovers (Hz)");
+    CLASS_ATTR_ACCESSORS(c, "bands", qrm_attr_get_bands, qrm_attr_set_bands);
+
+    CLASS_ATTR_SYM(c, "wisdom", 0, t_qrm, wisdom);
+    CLASS_ATTR_LABEL(c, "wisdom", 0, "FFTW Wisdom File");
+    CLASS_ATTR_ACCESSORS(c, "wisdom", qrm_attr_get_wisdom, qrm_attr_set_wisdom);
+    
+    CLASS_ATTR_SYM(c, "planner", 0, t_qrm, planner);
+    CLASS_ATTR_ENUM(c, "planner", 0, "estimate measure patient");
+    CLASS_ATTR_LABEL(c, "planner", 0, "FFTW Planning Rigor");
+    CLASS_ATTR_ACCESSORS(c, "planner", qrm_attr_get_planner, qrm_attr_set_planner);
+
+    CLASS_ATTR_LONG(c, "decay_eval", 0, t_qrm, decay_eval);
+    CLASS_ATTR_ENUMINDEX(c, "decay_eval", 0, "auto fft sparse track");
+    CLASS_ATTR_FILTER_CLIP(c, "decay_eval", QRM_DECAY_AUTO, QRM_DECAY_TRACK);
+    CLASS_ATTR_ACCESSORS(c, "decay_eval", NULL, qrm_attr_set_decay_eval);
+    CLASS_ATTR_LABEL(c, "decay_eval", 0, "Decay Slice Evaluation");
+
+    CLASS_ATTR_LONG(c, "num_slices", 0, t_qrm, num_slices);
+    CLASS_ATTR_FILTER_CLIP(c, "num_slices", QRM_MIN_SLICES, QRM_MAX_SLICES);
+    CLASS_ATTR_LABEL(c, "num_slices", 0, "Analysis Points For Decay");
+    CLASS_ATTR_ACCESSORS(c, "num_slices", NULL, qrm_attr_set_num_slices);
+
+    CLASS_ATTR_LONG_VARSIZE(c, "channels", 0, t_qrm, channels, num_channels, QRM_MAX_CHANNELS);
+    CLASS_ATTR_LABEL(c, "channels", 0, "Channels To Model Together (or all)");
+    CLASS_ATTR_ACCESSORS(c, "channels", qrm_attr_get_channels, qrm_attr_set_channels);
+    
+    CLASS_ATTR_CHAR(c, "merge", 0, t_qrm, merge);
+    CLASS_ATTR_STYLE_LABEL(c, "merge", 0, "onoff", "Merge Channel Models");
+    
+    CLASS_ATTR_LONG(c, "precision", 0, t_qrm, precision);
+    CLASS_ATTR_ENUMINDEX(c, "precision", 0, "double single");
+    CLASS_ATTR_FILTER_CLIP(c, "precision", QRM_PRECISION_DOUBLE, QRM_PRECISION_SINGLE);
+    CLASS_ATTR_LABEL(c, "precision", 0, "Spectrum Precision");
+    CLASS_ATTR_ACCESSORS(c, "precision", NULL, qrm_attr_set_precision);
+    
+    CLASS_ATTR_LONG(c, "slice_spacing", 0, t_qrm, slice_spacing);
+    CLASS_ATTR_ENUMINDEX(c, "slice_spacing", 0, "uniform log");
+    CLASS_ATTR_FILTER_CLIP(c, "slice_spacing", QRM_SPACING_UNIFORM, QRM_SPACING_LOG);
+    CLASS_ATTR_LABEL(c, "slice_spacing", 0, "Analysis Point Spacing");
+    CLASS_ATTR_ACCESSORS(c, "slice_spacing", NULL, qrm_attr_set_slice_spacing);
+
+    CLASS_ATTR_LONG(c, "max_partials", 0, t_qrm, max_partials);
+    CLASS_ATTR_FILTER_MIN(c, "max_partials", 0);
+    CLASS_ATTR_LABEL(c, "max_partials", 0, "Most Partials Per Result (0 for all)");
+    CLASS_ATTR_ACCESSORS(c, "max_partials", NULL, qrm_attr_set_max_partials);
+
+    CLASS_ATTR_DOUBLE(c, "partial_tol", 0, t_qrm, partial_tol);
+    CLASS_ATTR_FILTER_MIN(c, "partial_tol", 0.0);
+    CLASS_ATTR_LABEL(c, "partial_tol", 0, "Merge Partials Closer Than (Hz)");
+    CLASS_ATTR_ACCESSORS(c, "partial_tol", NULL, qrm_attr_set_partial_tol);
+
+    CLASS_ATTR_CHAR(c, "async", 0, t_qrm, async);
+    CLASS_ATTR_STYLE_LABEL(c, "async", 0, "onoff", "Analyze In Background Thread");
+    CLASS_ATTR_ACCESSORS(c, "async", NULL, qrm_attr_set_async);
+
+    CLASS_ATTR_CHAR(c, "coalesce", 0, t_qrm, coalesce);
+    CLASS_ATTR_STYLE_LABEL(c, "coalesce", 0, "onoff", "Latest Request Wins");
+    CLASS_ATTR_ACCESSORS(c, "coalesce", NULL, qrm_attr_set_coalesce);
+
+    CLASS_ATTR_LONG(c, "dropped", ATTR_SET_OPAQUE_USER, t_qrm, dropped);
+    CLASS_ATTR_LABEL(c, "dropped", 0, "Requests Dropped By Coalescing");
+
+    CLASS_ATTR_CHAR(c, "live", 0, t_qrm, live);
+    CLASS_ATTR_STYLE_LABEL(c, "live", 0, "onoff", "Analyze Live Input");
+    CLASS_ATTR_ACCESSORS(c, "live", NULL, qrm_attr_set_live);
+
+    CLASS_ATTR_DOUBLE(c, "live_region", 0, t_qrm, live_region);
+    CLASS_ATTR_FILTER_CLIP(c, "live_region", 10.0, QRM_LIVE_MAX_REGION);
+    CLASS_ATTR_LABEL(c, "live_region", 0, "Live Region After Onset (ms)");
+    CLASS_ATTR_ACCESSORS(c, "live_region", NULL, qrm_attr_set_live_region);
+
+    CLASS_ATTR_DOUBLE(c, "live_thresh", 0, t_qrm, live_thresh);
+    CLASS_ATTR_FILTER_MAX(c, "live_thresh", 0.0);
+    CLASS_ATTR_LABEL(c, "live_thresh", 0, "Onset Threshold (dB), Live and analyze_all");
+    CLASS_ATTR_ACCESSORS(c, "live_thresh", NULL, qrm_attr_set_live_thresh);
+
+    CLASS_ATTR_LONG(c, "batch_threads", 0, t_qrm, batch_threads);
+    CLASS_ATTR_FILTER_MIN(c, "batch_threads", 0);
+    CLASS_ATTR_LABEL(c, "batch_threads", 0, "Batch Threads (0 = one per core)");
+
+    CLASS_ATTR_LONG(c, "onsets", ATTR_SET_OPAQUE_USER, t_qrm, index_count);
+    CLASS_ATTR_LABEL(c, "onsets", 0, "Onsets In The Buffer Index");
+
+    CLASS_ATTR_LONG(c, "cache_size", 0, t_qrm, cache_size);
+    CLASS_ATTR_FILTER_MIN(c, "cache_size", 0);
+    CLASS_ATTR_LABEL(c, "cache_size", 0, "Model Cache Size (KB)");
+    CLASS_ATTR_ACCESSORS(c, "cache_size", NULL, qrm_attr_set_cache_size);
+
+    CLASS_ATTR_LONG(c, "prefetch", 0, t_qrm, prefetch);
+    CLASS_ATTR_FILTER_CLIP(c, "prefetch", 0, QRM_PREFETCH_DEPTH);
+    CLASS_ATTR_LABEL(c, "prefetch", 0, "Cursors Prefetched Ahead Of int");
 
+    CLASS_ATTR_LONG(c, "prefetch_stride", 0, t_qrm, prefetch_stride);
+    CLASS_ATTR_FILTER_MIN(c, "prefetch_stride", 0);
+    CLASS_ATTR_LABEL(c, "prefetch_stride", 0, "Prefetch Stride (0 for FFT Size / 4)");
+
+    CLASS_ATTR_LONG(c, "prefetch_tol", 0, t_qrm, prefetch_tol);
+    CLASS_ATTR_FILTER_MIN(c, "prefetch_tol", 0);
+    CLASS_ATTR_LABEL(c, "prefetch_tol", 0, "Prefetch Tolerance (samples)");
+
+    CLASS_ATTR_LONG(c, "bank_count", ATTR_SET_OPAQUE_USER, t_qrm, bank_count);
+    CLASS_ATTR_LABEL(c, "bank_count", 0, "Models In The Bank Read Last");
+
+    CLASS_ATTR_LONG(c, "prefetch_hits", ATTR_SET_OPAQUE_USER, t_qrm, prefetch_hits);
+    CLASS_ATTR_LABEL(c, "prefetch_hits", 0, "Requests Answered By Prefetch");
+
+    CLASS_ATTR_LONG(c, "cache_hits", ATTR_SET_OPAQUE_USER, t_qrm, cache_hits);
+    CLASS_ATTR_LABEL(c, "cache_hits", 0, "Model Cache Hits");
+
+    CLASS_ATTR_LONG(c, "cache_misses", ATTR_SET_OPAQUE_USER, t_qrm, cache_misses);
+    CLASS_ATTR_LABEL(c, "cache_misses", 0, "Model Cache Misses");
+
+    CLASS_ATTR_SYM(c, "sink", 0, t_qrm, sink);
+    CLASS_ATTR_LABEL(c, "sink", 0, "Write Results To buffer~");
+    CLASS_ATTR_ACCESSORS(c, "sink", NULL, qrm_attr_set_sink);
+
+    CLASS_ATTR_LONG(c, "footprint", ATTR_SET_OPAQUE_USER, t_qrm, footprint);
+    CLASS_ATTR_LABEL(c, "footprint", 0, "Working Memory (bytes)");
+
+    CLASS_ATTR_CHAR(c, "envelope", 0, t_qrm, envelope);
+    CLASS_ATTR_STYLE_LABEL(c, "envelope", 0, "onoff", "Find Attacks With Envelope Pyramid");
+    
+    qrm_core_init();
+
+    //plans are shared between instances, and wisdom from earlier sessions makes planning near-instant
+    systhread_mutex_new(&qrm_plans_mutex, 0);
+    qrm_wisdom_default_path(qrm_wisdom_path, sizeof(qrm_wisdom_path));
+    qrm_wisdom_import();
     
 
     
@@ -197,8 +930,13 @@ void qrm_perform64(t_qrm *x, t_object *dsp64, double **ins, long numins, double
     double        temp;
     double        f;
     long        index, chan, frames, nc;
-    t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
+    t_buffer_obj    *buffer;
 
+    if(x->live && x->ring){
+        qrm_live_perform(x, in, out, n);
+        return;
+    }
+    buffer = buffer_ref_getobject(x->l_buffer_reference);
     tab = buffer_locksamples(buffer);
     if (!tab)
         goto zero;
@@ -239,118 +977,125 @@ zero:
 //             );
 //}
 
-//when we get an int, set the cursor and print the fft input at that point in the target buffer, then the fft of that window
-//needs to be refactored
+//when we get an int, set the cursor and analyze the fft of the window at that point in the target buffer
 void qrm_int(t_qrm *x, long n)
 {
     if(n>=0)
     {
         x->cursor = n;
         
+        t_qrm_request r;
+        r.kind = QRM_REQ_INT;
+        r.id = x->next_id++;
+        r.c1 = n;
+        r.c2 = n;
+        qrm_cache_key(x, &r);
+        qrm_submit(x, &r);
+        qrm_prefetch_plan(x, n);
+    } else {
+        x->cursor = 0;
+        object_warn((t_object*)x, "Cursor values must be integers greater than zero. Setting to zero.");
+    }
+}
+
+//sinusoidal model at w->req.c1: window, fft, then (frequency, amplitude) pairs into w->cooked
+int qrm_analyze_int(t_qrm *x, t_qrm_work *w)
+{
         t_float *tab;
-        t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
-        x->sr = buffer_getsamplerate(buffer);
-        tab = buffer_locksamples(buffer);
+        long frames, nc, chan;
+        double t = qrm_now();
+        tab = qrm_samples_lock(x, w, &frames, &nc, &chan);
         if(!tab)
             goto zero;
-        //get buffer length. If window at cursor exceeds buffer length, truncate window.
-        long frames = buffer_getframecount(buffer);
-        long i = MIN(x->cursor, frames - x->fft_size);
+        //a buffer shorter than one window has nothing to analyze
+        if(frames < x->win_len){
+            qrm_samples_unlock(x, w);
+            object_error((t_object*)x, "buffer is shorter than the analysis window (%ld < %ld samples)", frames, x->win_len);
+            return 0;
+        }
+        //if window at cursor runs past the end of the buffer, slide it back
+        long i = MIN(w->req.c1, frames - x->win_len);
         
-        //get channels
-        long nc = buffer_getchannelcount(buffer);
-        long chan = MIN(x->l_chan, nc);
+        //single precision: window as we load, straight from the buffer's floats, and stay in float through peak picking
+        long nbins = x->fft_size/2 + 1;
+        if(x->precision == QRM_PRECISION_SINGLE){
+            for(int j=0; j< x->win_len;j++)
+                w->fin[j] = tab[(j+i)*nc+chan] * x->fwindow[j];
+            qrm_samples_unlock(x, w);
+            memset(w->fin + x->win_len, 0, sizeof(float) * (x->fft_size - x->win_len));
+            qrm_lap(w, QRM_STAGE_WINDOW, &t);
+            fftwf_execute_dft_r2c(x->p->pf, w->fin, (fftwf_complex *)w->fouts);
+            qrm_lap(w, QRM_STAGE_FFT, &t);
+            if(qrm_stale(x, w)) return 0;
+            spectrum_mags_f(w->fouts, nbins, w->fmag, &w->sum, &w->max_peak);
+            qrm_lap(w, QRM_STAGE_SPECTRUM, &t);
+            w->num_peaks = find_peaks_f(w->fmag, nbins, peak_floor(w->max_peak, x->thresh), w->peaks, x->fft_size / 2);
+            peak_mags_widen(w->fmag, w->peaks, w->num_peaks, w->mag_spec);
+            goto cook;
+        }
         
-        //load window into fft input
-        for(int j=0; j< x->fft_size;j++){
-            x->in[j] = tab[(j+i)*nc+chan];
-            //x->in[2*j+1] = 0;  //no imaginary component
-            //post("%d: %f", j, x->in[j]);
+        //load window into fft input, windowing as we go; zero-pad the rest of the fft
+        for(int j=0; j< x->win_len;j++){
+            w->in[j] = tab[(j+i)*nc+chan] * x->window_function[j];
+            //w->in[2*j+1] = 0;  //no imaginary component
+            //post("%d: %f", j, w->in[j]);
             
         }
-        buffer_unlocksamples(buffer);
+        qrm_samples_unlock(x, w);
+        memset(w->in + x->win_len, 0, sizeof(double) * (x->fft_size - x->win_len));
 
         
         //perform fft
-        hann_window(x, x->in);  //window the input
-        clock_t t1, t2;         //timing variables
-        t1=clock();             //start the clock
-        fftw_execute(x->p);     //do that FFT
-        t2 = clock();           //stop the clock
-//        post("qrm: fft took %f s", (double)(t2-t1)/CLOCKS_PER_SEC);
-        
-        //find bin width based on window size and sample rate
-        float bw = x->sr / x->fft_size;
-        //print_result(bw, x);
+        qrm_lap(w, QRM_STAGE_WINDOW, &t);
+        fftw_execute_dft_r2c(x->p->p, w->in, (fftw_complex *)w->outs);     //do that FFT
+        qrm_lap(w, QRM_STAGE_FFT, &t);
+        if(qrm_stale(x, w)) return 0;
         
-        //derive magnitude & phase, find sum and max
-        x->sum = 0;
-        double temp=0;
-        for(int i=0;i<x->fft_size;i++){
-            temp = sqrt(pow(x->outs[2*i],2) + pow(x->outs[2*i+1],2));
-            x->sum+=temp;
-            if(temp>=x->max_peak) x->max_peak = temp;
-            x->mag_spec[i]=temp;
-            x->phase_spec[i]=atan2(x->outs[2*i+1],x->outs[2*i]);
-        }
+        //derive magnitude, find sum and max in one pass
+        //only the first fft_size/2+1 bins of the r2c output mean anything
+        spectrum_mags(w->outs, nbins, w->mag_spec, &w->sum, &w->max_peak);
+        qrm_lap(w, QRM_STAGE_SPECTRUM, &t);
         
         
         
         //find peaks
-        int c = 0;
-        for(int i=1;i<x->fft_size-1;i++)
-        {
-            if((x->mag_spec[i-1]<x->mag_spec[i]) && (x->mag_spec[i+1]<x->mag_spec[i]))
-            {
-                //now check if the detected peak is within the threshold of our max peak
-                if(20*log10(x->mag_spec[i] / x->max_peak) > x->thresh)
-                {
-                    //only write if it is loud enough
-                    x->peaks[c]=i;
-                    c++;
-                }
-            }
-            x->peaks[c]=-1;
-        }
-        //let's track the number of peaks we've found (+1)
-        x->num_peaks=c;
-        c=0;
+        w->num_peaks = find_peaks(w->mag_spec, nbins, peak_floor(w->max_peak, x->thresh), w->peaks, x->fft_size / 2);
 
-//        while(x->peaks[c]>=0){
-//            post("qrm: peak at bin %ld: (%f Hz)", x->peaks[c], x->peaks[c]*bw);
+//        while(w->peaks[c]>=0){
+//            post("qrm: peak at bin %ld: (%f Hz)", w->peaks[c], w->peaks[c]*bw);
 //            c++;
 //        }
+    cook:
+        qrm_lap(w, QRM_STAGE_PEAKS, &t);
+        if(qrm_stale(x, w)) return 0;
+        
+        //find bin width based on window size and sample rate
+        float bw = w->sr / x->fft_size;
+        //print_result(bw, x);
         
         //cook the pitch with a fractional bin analysis
-        // /fractional_bins = [ 0, log(/spectrum[[/i+1]] / /spectrum[[/i -1]]) / (2 * log(pow(/spectrum[[/i]],2) / (/spectrum[[/i-1]] * /spectrum[[/i+1]]))), 0 ],
-        for(int i=0; i<x->num_peaks;i++){
-            long ind = x->peaks[i];
-            double f = ind;
-            //the following can be found in the literature on fractional bin extraction
-            //the log functions improve accuracy, but could be omitted or other numerical methods tried for efficiency
-            f += log(x->mag_spec[ind+1]/x->mag_spec[ind - 1]) / (2*log(pow(x->mag_spec[ind],2) / (x->mag_spec[ind+1] * x->mag_spec[ind - 1])) );
-            x->cooked[2*i] = f*bw;      //add cooked frequency to output list
-            x->cooked[2*i+1] = x->mag_spec[ind] / x->max_peak;  //add normalized amplitude to output list (for now)
+        for(int i=0; i<w->num_peaks;i++){
+            long ind = w->peaks[i];
+            double f = frac_bin(w->mag_spec, ind);
+            w->cooked[2*i] = f*bw;      //add cooked frequency to output list
+            w->cooked[2*i+1] = w->mag_spec[ind] / w->max_peak;  //add normalized amplitude to output list (for now)
 //            post("qrm: cooked bin %f: (%f Hz)", f, f*bw);
         }
-        qrm_list_out(x, x->cooked, x->num_peaks * 2, x->slice_out);     //list the cooked (frequency, amplitude) pairs out the outlet
-//        buffer_unlocksamples(buffer); //maybe move this earlier
-        return;
+        w->num_peaks = qrm_partials_limit(x, w, w->cooked, w->num_peaks, 2);
+        qrm_lap(w, QRM_STAGE_REFINE, &t);
+        return 1;
         
         
     zero:
 //        outlet_float(x->f_out, 0.0);
         object_error((t_object*)x, "Did not get buffer.");
-    } else {
-        x->cursor = 0;
-        object_warn((t_object*)x, "Cursor values must be integers greater than zero. Setting to zero.");
-    }
+        return 0;
 }
 
 void qrm_list(t_qrm *x, t_symbol *msg, long argc, t_atom *argv){
     
-    if(argc != 2){
-        object_error((t_object*)x,"Only supports list length of 2: (cursor1, cursor2)");
+    if(argc != 2 && argc != 3){
+        object_error((t_object*)x,"Only supports list length of 2 or 3: (cursor1, cursor2, [request id])");
         return;
     }
     
@@ -363,21 +1108,8 @@ void qrm_list(t_qrm *x, t_symbol *msg, long argc, t_atom *argv){
 
     long c1 = atom_getlong(argv);
     long c2 = atom_getlong(argv +1);
-    if(c1<0 || c1 >= buffer_len)
-    {
-        //buffer has no negative indices
-        if(c1<0) c1=0;
-        //need at least 1 fft frame of runway before end of buffer
-        if(c1>buffer_len - 1 - x->fft_size) c1 = buffer_len - 1 - x->fft_size;
-        object_warn((t_object*)x,"cursor1 position must be between zero and buffer length. Setting to %ld", c1);
-        
-    } else if(c2<0 || c2 >= buffer_len)
-    {
-        if(c2<0) c2=0;
-        if(c2>buffer_len - 1 - x->fft_size) c2 = buffer_len - 1 - x->fft_size;
-        object_warn((t_object*)x,"cursor2 position must be between zero and buffer length. Setting to %ld", c2);
-
-    }
+    if(!qrm_region_clamp(x, &c1, &c2, buffer_len))
+        return;
     
     x->cursor = c1;
     x->cursor2 = c2;
@@ -389,286 +1121,1106 @@ void qrm_list(t_qrm *x, t_symbol *msg, long argc, t_atom *argv){
         return;
     }
     
-    //adjust cursor 1 to first peak in buffer region
-    findMaxInBuffer(x);
-    c1 = x->region_max_ind;
-//    post("qrm: resetting cursor to attack at index %d", c1);
-    outlet_int(x->out, c1);
+    t_qrm_request r;
+    r.kind = QRM_REQ_LIST;
+    r.id = (argc == 3) ? atom_getlong(argv + 2) : x->next_id++;
+    r.c1 = c1;
+    r.c2 = c2;
+    //the index and the cache only know single-channel models
+    if(x->channels_all || x->num_channels){
+        r.kind = QRM_REQ_CHANNELS;
+        qrm_cache_key(x, &r);
+        r.key.buffer = NULL;
+        qrm_submit(x, &r);
+        return;
+    }
+    qrm_cache_key(x, &r);
+    qrm_submit(x, &r);
+}
+
+//pull out-of-range region cursors back into the buffer. Every slice reads a full window, so neither cursor may sit
+//closer than win_len to the end. Returns 0 if the buffer is shorter than one window.
+int qrm_region_clamp(t_qrm *x, long *c1, long *c2, long buffer_len)
+{
+    long last = buffer_len - x->win_len;
     
-    //set analysis points; needs some error checking
-    long step = (c2-c1)/4;
-//    post("qrm: setting slice indexes at:");
-    x->idxs[0]=x->slices[0].index_in_buffer;
-    for(int i=0;i<NUMSLICES; i++)
+    if(last < 0){
+        object_error((t_object*)x,"buffer is shorter than the analysis window (%ld < %ld samples)", buffer_len, x->win_len);
+        return 0;
+    }
+    if(*c1<0 || *c1 > last)
     {
-        x->slices[i].index_in_buffer = c1+i*step;
-//        post("qrm: \t %d", x->slices[i].index_in_buffer);
-        
-        x->idxs[i]=x->slices[i].index_in_buffer - x->idxs[0];
-        
+        //buffer has no negative indices, and we need at least 1 window of runway before end of buffer
+        *c1 = CLAMP(*c1, 0, last);
+        object_warn((t_object*)x,"cursor1 position must be between zero and buffer length minus one window. Setting to %ld", *c1);
     }
+    if(*c2<0 || *c2 > last)
+    {
+        *c2 = CLAMP(*c2, 0, last);
+        object_warn((t_object*)x,"cursor2 position must be between zero and buffer length minus one window. Setting to %ld", *c2);
+    }
+    return 1;
+}
+
+//batch: list of (c1, c2) pairs, analyzed in parallel. Every thread has its own work buffer (and so its own fft
+//scratch), the plans are shared. Results go out in the order the regions were given, the region's position in the
+//batch on the id outlet. With the channels attribute set every region is a channels request. When the worker is
+//running (async or live) the batch is analyzed there, after whatever was asked for before it; otherwise now.
+void qrm_batch(t_qrm *x, t_symbol *msg, long argc, t_atom *argv)
+{
+    t_qrm_batch *b;
     
-    //TODO:
-    //conduct qrm_int operations at c1, then perform ffts at the remaining 4 points, logging the amplitudes at bins identified as peaks at c1
+    if(argc < 2 || argc % 2){
+        object_error((t_object*)x,"batch needs (cursor1, cursor2) pairs");
+        return;
+    }
+    x->sr = buffer_getsamplerate(buffer_ref_getobject(x->l_buffer_reference));
+    qrm_in1(x,buffer_getchannelcount(buffer_ref_getobject(x->l_buffer_reference)));
+    long buffer_len = buffer_getframecount(buffer_ref_getobject(x->l_buffer_reference));
+    if(buffer_len < x->win_len){
+        object_error((t_object*)x,"buffer is shorter than the analysis window (%ld < %ld samples)", buffer_len, x->win_len);
+        return;
+    }
+    long kind = (x->channels_all || x->num_channels) ? QRM_REQ_CHANNELS : QRM_REQ_LIST;
     
-        
-        t_float *tab;
-        t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
-        x->sr = buffer_getsamplerate(buffer);
-        tab = buffer_locksamples(buffer);
-        if(!tab)
-            goto zero;
-        //get buffer length. If window at cursor exceeds buffer length, truncate window.
-//        long frames = buffer_getframecount(buffer);
-//        long i = x->cursor + x->fft_size;
-//        i = MIN(x->cursor, frames - x->fft_size);
-        
-        //get channels
-        long nc = buffer_getchannelcount(buffer);
-        long chan = MIN(x->l_chan, nc);
-        
-        
-        //load window into slice input buffers; window as we go
-    for(int k=0;k<x->fft_size;k++){
-        for(int j=0; j<NUMSLICES;j++){
-            x->slices[j].in[k]=tab[(k+x->slices[j].index_in_buffer) * nc+chan] * x->window_function[k];
+    b = malloc(sizeof(t_qrm_batch));
+    qrm_batch_init(b, x, argc / 2);
+    for(long i=0;i<b->count;i++){
+        long c1 = atom_getlong(argv + 2*i);
+        long c2 = atom_getlong(argv + 2*i + 1);
+        qrm_region_clamp(x, &c1, &c2, buffer_len);
+        if(c1>c2){
+            object_error((t_object*)x,"batch region %ld: cursor position 2 must be greater than cursor position 1", i);
+            c2 = -1;     //skipped
         }
+        b->reqs[i].kind = kind;
+        b->reqs[i].id = i;
+        b->reqs[i].c1 = c1;
+        b->reqs[i].c2 = c2;
     }
-    buffer_unlocksamples(buffer);
-        
-        //perform ffts
-    for(int i=0;i<NUMSLICES; i++){
-        fftw_execute(x->slices[i].p);
+    
+    if(x->worker && (x->async || x->live)){
+        systhread_mutex_lock(x->queue_mutex);
+        b->seq = x->next_seq++;
+        if(x->batch_tail) x->batch_tail->link = b;
+        else x->batch_head = b;
+        x->batch_tail = b;
+        systhread_cond_signal(x->queue_cond);
+        systhread_mutex_unlock(x->queue_mutex);
+        return;
     }
+    qrm_batch_analyze(b);
+    qrm_batch_out(x, b);
+    qrm_batch_free(b);
+    free(b);
+}
 
-        //find bin width based on window size and sample rate (move this to set_fft_size
-    float bw = x->sr / x->fft_size;   //TODO: put this in new and set_fft_size
-
-        //derive magnitude & phase of slice[0], find sum and max
-    x->slices[0].sum = 0;
-    x->slices[0].max_peak=0;
-        
-        double temp=0;
-        for(int i=0;i<x->fft_size;i++){
-            temp = sqrt(pow(x->slices[0].outs[2*i],2) + pow(x->slices[0].outs[2*i+1],2));
-            x->slices[0].sum += temp;
-            if(temp>=x->slices[0].max_peak)
-            {
-                x->slices[0].max_peak = temp;
-                //now we also need mag and phase spec for the other slices for this bin
-                for(int j=1;j<NUMSLICES;j++){
-                    x->slices[j].mag_spec[i]=sqrt(pow(x->slices[j].outs[2*i],2) + pow(x->slices[j].outs[2*i+1],2));
-                    x->slices[j].phase_spec[i]=atan2(x->slices[j].outs[2*i+1],x->slices[j].outs[2*i]);
-                }
+//publish and send out every region of a finished batch that was analyzed, in region order. Models are clamped to
+//what the published state holds now, in case fft_size came down since the batch ran.
+void qrm_batch_out(t_qrm *x, t_qrm_batch *b)
+{
+    long npeaks = x->fft_size/2;
+    
+    for(long i=0;i<b->count;i++){
+        if(!b->ok[i]) continue;
+        x->last_req = b->reqs[i];
+        x->num_model = MIN(b->num[i], npeaks);
+        memcpy(x->model, b->models[i], sizeof(double) * x->num_model * 3);
+        x->region_max_ind = b->attack[i];
+        x->max_val = b->max_val[i];
+        x->num_ch = 0;
+        if(b->chans[i]){
+            t_qrm_batch_channels *bc = b->chans[i];
+            const double *m = bc->models;
+            size_t bytes = sizeof(double) * bc->nch * npeaks * 3;
+            if(x->ch_alloc < bytes){
+                if(x->ch_models !=NULL) free(x->ch_models);
+                x->ch_models = malloc(bytes);
+                x->ch_alloc = bytes;
             }
-            x->slices[0].mag_spec[i]=temp;
-            x->slices[0].phase_spec[i]=atan2(x->slices[0].outs[2*i+1],x->slices[0].outs[2*i]);
-            
-
+            for(long c=0;c<bc->nch;c++){
+                x->ch_num[c] = MIN(bc->num[c], npeaks);
+                x->ch_list[c] = bc->ch[c];
+                memcpy(x->ch_models + c*npeaks*3, m, sizeof(double) * x->ch_num[c] * 3);
+                m += bc->num[c] * 3;
+            }
+            x->num_ch = bc->nch;
         }
-        
-        
+        qrm_output(x);
+    }
+}
 
+//room for count regions; the caller fills in b->reqs
+void qrm_batch_init(t_qrm_batch *b, t_qrm *x, long count)
+{
+    b->x = x;
+    b->count = count;
+    b->reqs = calloc(MAX(1, count), sizeof(t_qrm_request));
+    b->models = calloc(MAX(1, count), sizeof(double *));
+    b->num = calloc(MAX(1, count), sizeof(long));
+    b->attack = calloc(MAX(1, count), sizeof(long));
+    b->max_val = calloc(MAX(1, count), sizeof(float));
+    b->ok = calloc(MAX(1, count), sizeof(char));
+    b->chans = calloc(MAX(1, count), sizeof(t_qrm_batch_channels *));
+    b->seq = 0;
+    b->link = NULL;
+    atomic_init(&b->next, 0);
+}
 
-        //find peaks in slice 0
-        int c = 0;
-        for(int i=1;i<x->fft_size-1;i++)
-        {
-            if((x->slices[0].mag_spec[i-1] < x->slices[0].mag_spec[i]) && (x->slices[0].mag_spec[i+1] < x->slices[0].mag_spec[i]))
-            {
-                //now check if the detected peak is within the threshold of our max peak
-                if(20*log10(x->slices[0].mag_spec[i] / x->slices[0].max_peak) > x->thresh)
-                {
-                    //only write if it is loud enough
-                    x->peaks[c]=i;
-                    c++;
-                }
-               
+//analyze every region of the batch, blocking until all are done
+void qrm_batch_analyze(t_qrm_batch *b)
+{
+    t_qrm *x = b->x;
+    t_qrm_batch_thread *t;
+    long nthreads;
+    unsigned int ret;
+    
+    if(!b->count) return;
+    nthreads = x->batch_threads > 0 ? x->batch_threads : qrm_cpu_count();
+    nthreads = CLAMP(nthreads, 1, b->count);
+    t = calloc(nthreads, sizeof(t_qrm_batch_thread));
+    
+    //fft_size (and with it the plans and window) must stay put while the threads run
+    systhread_mutex_lock(x->analysis_mutex);
+    systhread_mutex_lock(x->queue_mutex);
+    for(long i=0;i<b->count;i++) b->reqs[i].seq = x->latest_seq[b->reqs[i].kind];  //never stale
+    systhread_mutex_unlock(x->queue_mutex);
+    for(long i=0;i<nthreads;i++){
+        t[i].b = b;
+        qrm_work_alloc(x, &t[i].w);
+    }
+    //this thread takes a share too
+    for(long i=1;i<nthreads;i++)
+        systhread_create((method)qrm_batch_thread, &t[i], 0, 0, 0, &t[i].th);
+    qrm_batch_run(&t[0]);
+    for(long i=1;i<nthreads;i++)
+        systhread_join(t[i].th, &ret);
+    for(long i=0;i<nthreads;i++) qrm_work_free(&t[i].w);
+    systhread_mutex_unlock(x->analysis_mutex);
+    free(t);
+}
+
+//frees the results too; take ownership of a model by setting its pointer to NULL first
+void qrm_batch_free(t_qrm_batch *b)
+{
+    for(long i=0;i<b->count;i++){
+        if(b->models[i] !=NULL) free(b->models[i]);
+        if(b->chans[i] !=NULL) free(b->chans[i]);
+    }
+    free(b->reqs);
+    free(b->models);
+    free(b->num);
+    free(b->attack);
+    free(b->max_val);
+    free(b->ok);
+    free(b->chans);
+}
+
+//one batch thread: take the next region until there are none left, keep a copy of each result
+void qrm_batch_run(t_qrm_batch_thread *t)
+{
+    t_qrm_batch *b = t->b;
+    t_qrm_work *w = &t->w;
+    long i;
+    
+    while((i = atomic_fetch_add(&b->next, 1)) < b->count){
+        if(b->reqs[i].c2 < 0) continue;
+        w->req = b->reqs[i];
+        if(!qrm_analyze(b->x, w)) continue;
+        b->models[i] = malloc(sizeof(double) * MAX(1, w->num_peaks * 3));
+        memcpy(b->models[i], w->model, sizeof(double) * w->num_peaks * 3);
+        b->num[i] = w->num_peaks;
+        b->attack[i] = w->attack;
+        b->max_val[i] = w->max_val;
+        if(w->req.kind == QRM_REQ_CHANNELS){
+            long total = 0, stride = b->x->fft_size/2 * 3;
+            for(long c=0;c<w->nch;c++) total += w->ch_num[c];
+            t_qrm_batch_channels *bc = malloc(sizeof(t_qrm_batch_channels) + sizeof(double) * MAX(1, total * 3));
+            bc->models = (double *)(bc + 1);
+            bc->nch = w->nch;
+            for(long c=0, k=0;c<w->nch;c++){
+                bc->ch[c] = w->ch[c];
+                bc->num[c] = w->ch_num[c];
+                memcpy(bc->models + k, w->ch_models + c*stride, sizeof(double) * w->ch_num[c] * 3);
+                k += w->ch_num[c] * 3;
             }
-            x->peaks[c]=-1;
+            b->chans[i] = bc;
         }
-        //let's track the number of peaks we've found (+1)
-        x->num_peaks=c;
-        c=0;
+        b->ok[i] = 1;
+    }
+}
 
+void *qrm_batch_thread(t_qrm_batch_thread *t)
+{
+    qrm_batch_run(t);
+    systhread_exit(0);
+    return NULL;
+}
 
-        
-        
-        
-//        while(x->peaks[c]>=0){
-//            post("qrm: peak at bin %ld: (%f Hz)", x->peaks[c], x->peaks[c]*bw);
-//            c++;
-//        }
+long qrm_cpu_count(void)
+{
+#ifdef WIN_VERSION
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    return MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+}
+
+//resonant model over w->req.c1..c2: find the attack, fft all slices, fit decays, (frequency, amplitude, decay) into w->model
+int qrm_analyze_list(t_qrm *x, t_qrm_work *w)
+{
+    //adjust cursor 1 to first peak in buffer region
+    double t = qrm_now();
+    if(!findMaxInBuffer(x, w))
+        return 0;
+    qrm_lap(w, QRM_STAGE_ATTACK, &t);
+    qrm_slice_positions(x, w);
     
-        //work out decay rates from peak bins
-    temp=0;
-    for(int i=0; i<x->num_peaks; i++){
-        for(int j = 0;j<NUMSLICES;j++) {
-            x->tempY[j]=x->slices[j].mag_spec[x->peaks[i]]+EPSILON;
-//            post("qrm: Peak %d: Amp %d: %f", i, j, x->tempY[j]);
-        }
-        exp_fit(x->idxs, x->tempY, NUMSLICES, x->tempAB, 10 );
-        x->amps[i] = x->tempAB[0];
-        temp=MAX(temp, x->tempAB[0]);
-        x->dr[i] = x->tempAB[1]*x->sr; //we multiply by sampling rate here to correct for scaling
+        t_float *tab;
+        long frames, nc, chan;
+        tab = qrm_samples_lock(x, w, &frames, &nc, &chan);
+        if(!tab)
+            goto zero;
+        //get buffer length. If window at cursor exceeds buffer length, truncate window.
+//        long i = x->cursor + x->fft_size;
+//        i = MIN(x->cursor, frames - x->fft_size);
         
-    }
-    
-//    //normalize amps
-//    for(int i=0; i<x->num_peaks; i++) x->amps[i] /= temp;
-    
-    
         
-        //cook the pitch with a fractional bin analysis
-        // /fractional_bins = [ 0, log(/spectrum[[/i+1]] / /spectrum[[/i -1]]) / (2 * log(pow(/spectrum[[/i]],2) / (/spectrum[[/i-1]] * /spectrum[[/i+1]]))), 0 ],
-        for(int i=0; i<x->num_peaks;i++){
-            long ind = x->peaks[i];
-            double f = ind;
-            //the following can be found in the literature on fractional bin extraction
-            //the log functions improve accuracy, but could be omitted or other numerical methods tried for efficiency
-            f += log(x->slices[0].mag_spec[ind+1]/x->slices[0].mag_spec[ind - 1]) / (2*log(pow(x->slices[0].mag_spec[ind],2) / (x->slices[0].mag_spec[ind+1] * x->slices[0].mag_spec[ind - 1])) );
-            x->model[3*i] = f*bw;      //add cooked frequency to output list
-            x->model[3*i+1] = x->amps[i] / x->slices[0].max_peak;  //add normalized amplitude to output list;
-            x->model[3*i+2] = MAX(2.0, ABS(x->dr[i])); //impose a constraint of positive and greater than threshold
-            //catch NaNs
-            if(x->model[3*i+1] != x->model[3*i+1] || x->model[3*i+1] != x->model[3*i+1]){
-                x->model[3*i+1] = 0.0;
-                x->model[3*i+2] = 10;
-            }
-//            post("qrm: cooked bin %f: (%f Hz)", f, f*bw);
-            
-        }
-        qrm_list_out(x, x->model, x->num_peaks * 3, x->model_out);     //list the cooked (frequency, amplitude) pairs out the outlet
-//        buffer_unlocksamples(buffer); //maybe move this earlier
-        return;
+        //load window into slice input buffers; window as we go
+    const t_float *src[QRM_MAX_SLICES];
+    for(int j=0; j<x->num_slices;j++)
+        src[j] = tab + w->slices[j].index_in_buffer * nc + chan;
+    qrm_slices_window(x, w, src, nc);
+    if(x->decay_eval == QRM_DECAY_TRACK && !qrm_track_fetch(x, w, tab, frames, nc, chan)){
+        qrm_samples_unlock(x, w);
+        return 0;
+    }
+    qrm_samples_unlock(x, w);
+    qrm_lap(w, QRM_STAGE_WINDOW, &t);
+    return qrm_model_fit(x, w);
         
         
     zero:
 //        outlet_float(x->f_out, 0.0);
         object_error((t_object*)x,"Did not get buffer.");
+        return 0;
 }
 
+//keep the samples decay_eval track follows the peaks through: from the attack to a window past the region's end.
+//Live regions are already a private copy; buffer~ samples are copied out, deinterleaved, before the unlock.
+int qrm_track_fetch(t_qrm *x, t_qrm_work *w, const t_float *tab, long frames, long nc, long chan)
+{
+    long len = MIN(frames - w->attack, w->req.c2 - w->attack + x->win_len);
+    
+    if(w->req.kind == QRM_REQ_LIVE){
+        w->track = tab + w->attack;
+        w->track_len = len;
+        return 1;
+    }
+    if(w->track_alloc < len){
+        if(w->track_buf !=NULL) free(w->track_buf);
+        w->track_buf = malloc(sizeof(t_float) * len);
+        w->track_alloc = w->track_buf ? len : 0;
+    }
+    if(!w->track_buf){
+        object_error((t_object*)x, "out of memory for tracking %ld samples", len);
+        return 0;
+    }
+    for(long i=0;i<len;i++) w->track_buf[i] = tab[(w->attack + i)*nc + chan];
+    w->track = w->track_buf;
+    w->track_len = len;
+    return 1;
+}
 
-
-
-void qrm_set(t_qrm *x, t_symbol *s)
+//the rest of a list analysis, once the slices are windowed: each band's ffts, peaks in slice 0 and decay fit, and
+//the (frequency, amplitude, decay) triples in w->model, in ascending frequency. Every band's slice 0 spectrum is
+//worked out before any peaks are picked, since the threshold and the amplitudes are relative to the loudest of them.
+int qrm_model_fit(t_qrm *x, t_qrm_work *w)
 {
-    if (!x->l_buffer_reference)
-        x->l_buffer_reference = buffer_ref_new((t_object *)x, s);
-    else
-        buffer_ref_set(x->l_buffer_reference, s);
+    double t = qrm_now();
+    long n = 0, prev = 0;
+    double ref = 0;
+    double edge = x->band[0].hi;        //the first crossover, if there is one
     
-    //the buffer may have a different sample rate.  Let's find out what it is and reset our SR to match.
-    t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
-    x->sr = buffer_getsamplerate(buffer);
-    long nc = buffer_getchannelcount(buffer);
-    qrm_in1(x,nc);
+    if(x->band[0].decim > 1){
+        qrm_band_decimate(x, w);
+        qrm_lap(w, QRM_STAGE_WINDOW, &t);
+            //decim was chosen at the object's sample rate; a buffer~ at a lower one moves the crossover down to
+            //what the decimated band still holds
+        edge = MIN(edge, w->sr / (4 * x->band[0].decim));
+    }
+    for(int b=0; b<x->num_bands; b++){
+        const t_qrm_band *bd = &x->band[b];
+        double m = qrm_band_spectrum(x, w, b, b == 1 ? edge : bd->lo, b ? bd->hi : edge);
+        if(m < 0) return 0;
+        ref = MAX(ref, m / bd->scale);
+    }
+    for(int b=0; b<x->num_bands; b++){
+        long m = qrm_band_fit(x, w, b, ref, w->model + 3*n, x->fft_size/2 - n);
+        if(m < 0) return 0;
+        if(b) m = qrm_band_dedupe(w->model + 3*prev, n - prev, w->model + 3*n, m, w->sr / x->band[b].fft_size);
+        prev = n;
+        n += m;
+    }
+    w->num_peaks = qrm_partials_limit(x, w, w->model, n, 3);
+    return 1;
 }
 
-void qrm_setvsize(t_qrm *x, long n)
+//filter and decimate band 0's windows, full length in the slice block, down into its stretch of band_in: log2(decim)
+//half-band stages, each slice's intermediate ones in the scratch of int requests (w->in or w->fin), one after another
+void qrm_band_decimate(t_qrm *x, t_qrm_work *w)
 {
-    if(n>0){
-        x->sample_vector_size =n;
-        object_warn((t_object*)x,"Vector size will be set to %d", n);
-    } else {
-        x->sample_vector_size = 1;
-        object_warn((t_object*)x,"Sample Vector Size must be a positive integer. Setting to 1");
+    const t_qrm_band *bd = &x->band[0];
+    
+    for(int j=0; j<x->num_slices; j++){
+        long n = x->fft_size, off = 0;
+        if(x->precision == QRM_PRECISION_SINGLE){
+            const float *src = w->slices[j].fin;
+            for(long d=2; d<=bd->decim; d*=2){
+                float *dst = d == bd->decim ? w->fband_in + j * x->band_idist + bd->in_off : w->fin + off;
+                halfband_decimate_f(src, n, dst);
+                src = dst;
+                off += n/2;
+                n /= 2;
+            }
+        } else {
+            const double *src = w->slices[j].in;
+            for(long d=2; d<=bd->decim; d*=2){
+                double *dst = d == bd->decim ? w->band_in + j * x->band_idist + bd->in_off : w->in + off;
+                halfband_decimate(src, n, dst);
+                src = dst;
+                off += n/2;
+                n /= 2;
+            }
+        }
     }
 }
 
-void qrm_getvsize(t_qrm *x)
+//partial_tol and max_partials on one result of num tuples (width values each, ascending frequency). Neighbours
+//are merged first, so a partial split over two bins counts once towards the limit. w->amps is free by now and
+//serves as the selection scratch.
+long qrm_partials_limit(t_qrm *x, t_qrm_work *w, double *a, long num, long width)
 {
-    outlet_int(x->out, x->sample_vector_size);
-    object_post((t_object*)x,"Sample Vector Size is %d", x->sample_vector_size);
+    if(x->partial_tol > 0) num = partials_merge(a, num, width, x->partial_tol);
+    if(x->max_partials > 0) num = partials_top(a, num, width, x->max_partials, w->amps);
+    return num;
 }
 
-void qrm_set_fft_size(t_qrm *x, long n)
+//first pass of one band of qrm_model_fit: slice 0's fft, and its magnitudes over the band's bins from lo to hi Hz
+//(0 for up to Nyquist), whose range it leaves in w->band_lo and w->band_hi. Returns the loudest of those
+//magnitudes, or -1 if the request went stale.
+double qrm_band_spectrum(t_qrm *x, t_qrm_work *w, int band, double lo, double hi)
 {
-    if(n>0){
-        //bitwise-& checks for power of 2
-        if((n & (n-1)) == 0){
-            x->fft_size = n;
-            
-            //when resetting fft size we need to free and re-allocate memory
-            //otherwise, we get a crash
-            if(x->in != NULL) fftw_free((char *)x->in); x->in = NULL;
-            if(x->outs !=NULL) fftw_free((char *)x->outs); x->outs = NULL;
-            x->in = (double *) fftw_malloc(sizeof(double) * (x->fft_size));
-            x->outs = (double *) fftw_malloc(sizeof(double) * (x->fft_size)*2);
-            memset(x->in, '\0', x->fft_size * sizeof(double));
-            memset(x->outs, '\0', x->fft_size * 2 * sizeof(double));
-            
-            //reset window function
-            if(x->window_function !=NULL) free(x->window_function);
-            x->window_function = malloc(sizeof(double)*((int)x->fft_size));
-            hann_window_gen(x);
-            
-            
-            //make a new plan. If one already exists, kill it and build a new one for the new fft size.
-            //note, using the FFTW_MEASURE flag adds a beat, but optimizes for fast execution.
-            //one could also use the FFTW_PATIENT flag here to really optimize at the expense an even longer wait.
-            if(x->p !=NULL) fftw_destroy_plan(x->p);
-            x->p = fftw_plan_dft_r2c_1d((int)x->fft_size, x->in, (fftw_complex *)x->outs, FFTW_MEASURE);
-            
-            if(x->mag_spec !=NULL) free(x->mag_spec); x->mag_spec = NULL;
-            if(x->phase_spec !=NULL) free(x->phase_spec); x->phase_spec = NULL;
-            x->mag_spec = malloc(sizeof(double)*(x->fft_size));     //these could be half as long
-            x->phase_spec = malloc(sizeof(double)*(x->fft_size));
-            
-            if(x->peaks !=NULL) free(x->peaks); x->peaks=NULL;
-            x->peaks = malloc(sizeof(long)*(x->fft_size / 2));
-            
-            //we also need to change the size of our cooked array:
-            if(x->cooked !=NULL) free(x->cooked); x->cooked = NULL;
-            x->cooked = malloc(sizeof(double) * (x->fft_size));
-            
-            if(x->model !=NULL) free(x->model); x->model = NULL;
-            x->model = malloc(sizeof(double) * (x->fft_size * 3));
-           
-            if(x->ap0 !=NULL) free(x->ap0);
-            x->ap0 = malloc(sizeof(double)*(x->fft_size / 2));
-            if(x->ap1 !=NULL) free(x->ap1);
-            x->ap1 = malloc(sizeof(double)*(x->fft_size / 2));
-            if(x->ap2 !=NULL) free(x->ap2);
-            x->ap2 = malloc(sizeof(double)*(x->fft_size / 2));
-            if(x->ap3 !=NULL) free(x->ap3);
-            x->ap3 = malloc(sizeof(double)*(x->fft_size / 2));
-            if(x->ap4 !=NULL) free(x->ap4);
-            x->ap4 = malloc(sizeof(double)*(x->fft_size / 2));
-            
-            if(x->amps !=NULL) free(x->amps);
-            x->amps = malloc(sizeof(double) * x->fft_size);
-            
-            if(x->dr !=NULL) free(x->dr);
-            x->dr=malloc(sizeof(double) * x->fft_size);
-            
-            for(int i=0; i<NUMSLICES; i++){
-                if(x->slices[i].in !=NULL) fftw_free((char * )x->slices[i].in);
-                if(x->slices[i].outs !=NULL) fftw_free((char *)x->slices[i].outs);
-                x->slices[i].in = (double *) fftw_malloc(sizeof(double) * (x->fft_size));
-                x->slices[i].outs = (double *) fftw_malloc(sizeof(double) * (x->fft_size)*2);
-                memset(x->slices[i].in, '\0', x->fft_size * sizeof(double));
-                memset(x->slices[i].outs, '\0', x->fft_size * 2 * sizeof(double));
-                if(x->slices[i].mag_spec !=NULL) free(x->slices[i].mag_spec);
-                x->slices[i].mag_spec = malloc(sizeof(double) * x->fft_size);
-                if(x->slices[i].phase_spec !=NULL) free(x->slices[i].phase_spec);
-                x->slices[i].phase_spec = malloc(sizeof(double) * x->fft_size);
-                
-                if(x->slices[i].p !=NULL) fftw_destroy_plan(x->slices[i].p);
-                x->slices[i].p = fftw_plan_dft_r2c_1d((int)x->fft_size, x->slices[i].in, (fftw_complex *)x->slices[i].outs, FFTW_MEASURE);
+    double t = qrm_now();
+    const t_qrm_band *bd = &x->band[band];
+    long size = bd->fft_size;
+    int single = x->precision == QRM_PRECISION_SINGLE;
+    int top = bd == x->band && bd->decim == 1;
+    
+        //undecimated band 0's windows are in the slice block, the others' in band_in; the spectra all go to the slice block
+    double *in = top ? w->slice_in : w->band_in + bd->in_off;
+    float *fin = top ? w->fslice_in : w->fband_in + bd->in_off;
+        
+        //perform ffts. slice 0 needs its spectrum for peak picking, but the other slices are only ever read at the
+        //peak bins, so they wait until we know how many peaks there are. A single band asked for full ffts does
+        //them all now in one batch; with more, the next band's slice 0 would land on top of them.
+    t_qrm_plan *plan = x->decay_eval == QRM_DECAY_FFT && x->num_bands == 1 ? x->slice_plan : bd->p;
+    if(single)
+        fftwf_execute_dft_r2c(plan->pf, fin, (fftwf_complex *)w->fslice_outs);
+    else
+        fftw_execute_dft_r2c(plan->p, in, (fftw_complex *)w->slice_outs);
+    qrm_lap(w, QRM_STAGE_FFT, &t);
+    if(qrm_stale(x, w)) return -1;
+
+        //bin width of this band, at the sample rate of whatever is being analyzed (buffer~ or live input);
+        //decimating leaves it as it was
+    double bw = w->sr / (size * bd->decim);
+
+        //r2c output only holds size/2+1 bins per slice; past that we would read the next slice
+    long nbins = size/2 + 1;
+        //this band's bins: lo <= k*bw < hi, never the end bins, which have only one neighbour. Peaks are picked
+        //from the spectrum starting one bin below lo, so the first bin find_peaks tests is lo itself. Only that
+        //stretch gets magnitudes, at mag_off in the spectra every band shares, and its loudest is the band's.
+    long klo = MAX(1, (long)ceil(lo / bw));
+    long khi = hi > 0 ? MIN(nbins - 1, (long)ceil(hi / bw)) : nbins - 1;
+    if(klo > khi) klo = khi;
+    w->band_lo[band] = klo;
+    w->band_hi[band] = khi;
+    if(single)
+        spectrum_mags_f(w->slices[0].fouts + 2*(klo - 1), khi - klo + 2, w->fmag + bd->mag_off + klo - 1, &w->slices[0].sum, &w->slices[0].max_peak);
+    else
+        spectrum_mags(w->slices[0].outs + 2*(klo - 1), khi - klo + 2, w->slices[0].mag_spec + bd->mag_off + klo - 1, &w->slices[0].sum, &w->slices[0].max_peak);
+    qrm_lap(w, QRM_STAGE_SPECTRUM, &t);
+    return w->slices[0].max_peak;
+}
+
+//second pass of one band of qrm_model_fit: at most max triples for the partials in the bins qrm_band_spectrum
+//found for it, into model. ref is the loudest partial of any band, as undecimated band 0 would have it;
+//amplitudes and the peak threshold are relative to that, scaled to the band, so a partial comes out the same
+//level in whichever band finds it. Returns the number of triples, or -1 if the request went stale.
+long qrm_band_fit(t_qrm *x, t_qrm_work *w, int band, double ref, double *model, long max)
+{
+    double t = qrm_now();
+    const t_qrm_band *bd = &x->band[band];
+    long ns = x->num_slices;
+    long size = bd->fft_size;
+    int single = x->precision == QRM_PRECISION_SINGLE;
+    int top = bd == x->band && bd->decim == 1;
+    long idist = top ? x->slice_idist : x->band_idist;
+    double *in = top ? w->slice_in : w->band_in + bd->in_off;
+    float *fin = top ? w->fslice_in : w->fband_in + bd->in_off;
+    double *mag = w->slices[0].mag_spec + bd->mag_off;
+    long lo = w->band_lo[band];
+    long hi = w->band_hi[band];
+    double bw = w->sr / (size * bd->decim);
+    double scale = bd->scale;
+    double temp=0;
+
+        //find peaks in slice 0
+    if(single){
+        w->num_peaks = find_peaks_f(w->fmag + bd->mag_off + lo - 1, hi - lo + 2, peak_floor(ref * scale, x->thresh), w->peaks, MIN(max, size / 2));
+        for(int i=0; i<w->num_peaks; i++) w->peaks[i] += lo - 1;
+        peak_mags_widen(w->fmag + bd->mag_off, w->peaks, w->num_peaks, mag);
+    } else {
+        w->num_peaks = find_peaks(mag + lo - 1, hi - lo + 2, peak_floor(ref * scale, x->thresh), w->peaks, MIN(max, size / 2));
+        for(int i=0; i<w->num_peaks; i++) w->peaks[i] += lo - 1;
+    }
+
+//    while(w->peaks[c]>=0){
+//        post("qrm: peak at bin %ld: (%f Hz)", w->peaks[c], w->peaks[c]*bw);
+//        c++;
+//    }
+    qrm_lap(w, QRM_STAGE_PEAKS, &t);
+    if(qrm_stale(x, w)) return -1;
+
+        //now we need the magnitudes of the other slices at the peak bins. Goertzel costs O(win_len) per peak,
+        //the ffts O(size log size) regardless of peaks, so a handful of peaks is cheaper sparse.
+        //Tracking follows the peaks through QRM_TRACK_POINTS windows spread over the whole region instead, at
+        //O(peaks) a sample; without enough region for three windows it falls back to the slices, sparse.
+        //It reads the samples themselves, so a decimated band tracks at the full rate and window.
+    long tsize = size * bd->decim;
+    long tlen = bd->decim > 1 ? x->win_len : bd->win_len;
+    long span = w->track_len - tlen;
+    long hop = MAX(1, span / (QRM_TRACK_POINTS-1));
+    long points = span >= 0 ? MIN(QRM_TRACK_POINTS, span / hop + 1) : 0;
+    int track = x->decay_eval == QRM_DECAY_TRACK && points >= 3;
+    int sparse = x->decay_eval == QRM_DECAY_SPARSE || x->decay_eval == QRM_DECAY_TRACK ||
+        (x->decay_eval == QRM_DECAY_AUTO &&
+         w->num_peaks * bd->win_len < QRM_SPARSE_PEAKS_PER_LOG2 * size * log2((double)size));
+    for(long j=0; track && j<points; j++) w->track_idxs[j] = j * hop;
+    if((x->decay_eval == QRM_DECAY_FFT && x->num_bands > 1) || (x->decay_eval == QRM_DECAY_AUTO && !sparse)){
+        if(single)
+            fftwf_execute_dft_r2c(bd->decay_plan->pf, fin + idist, (fftwf_complex *)w->slices[1].fouts);
+        else
+            fftw_execute_dft_r2c(bd->decay_plan->p, in + idist, (fftw_complex *)w->slices[1].outs);
+        qrm_lap(w, QRM_STAGE_FFT, &t);
+    }
+    //gather the peak magnitudes a block of peaks at a time into fit_y, slice-major (fit_y[j*np+i] is peak b+i in
+    //slice j), then work out decay rates for the whole block with one pass down each slice's row
+    temp=0;
+    for(int b=0; b<w->num_peaks; b+=QRM_FIT_BLOCK){
+        long np = MIN(QRM_FIT_BLOCK, w->num_peaks - b);
+        double *y = w->fit_y;
+        if(track){
+            //a dense envelope needs no extra weight on its ends, so the fit is left unbiased
+            sdft_track(w->track, points, hop, tsize, tlen, w->peaks + b, np, y, w->track_state);
+            exp_fit_batch(w->track_idxs, points, y, np, 1, w->fit_sums, w->amps + b, w->dr + b);
+            if(bd->decim > 1)
+                for(long i=0;i<np;i++) w->amps[b+i] *= scale;
+            continue;
+        }
+        for(int i=0;i<np;i++) y[i] = mag[w->peaks[b+i]];
+        for(int i=0;i<np;i++){
+            long k = w->peaks[b+i];
+            if(sparse && single){
+                goertzel_mags_f(fin + idist, idist, ns-1, size, bd->win_len, k, y + np + i, np);
+            } else if(sparse){
+                goertzel_mags(in + idist, idist, ns-1, size, bd->win_len, k, y + np + i, np);
+            } else if(single){
+                for(int j=1;j<ns;j++)
+                    y[j*np+i]=sqrt((double)w->slices[j].fouts[2*k]*w->slices[j].fouts[2*k] + (double)w->slices[j].fouts[2*k+1]*w->slices[j].fouts[2*k+1]);
+            } else {
+                for(int j=1;j<ns;j++)
+                    y[j*np+i]=sqrt(pow(w->slices[j].outs[2*k],2) + pow(w->slices[j].outs[2*k+1],2));
+            }
+        }
+        exp_fit_batch(w->idxs, ns, y, np, 10, w->fit_sums, w->amps + b, w->dr + b);
+    }
+    for(int i=0; i<w->num_peaks; i++){
+        temp=MAX(temp, w->amps[i]);
+        w->dr[i] *= w->sr; //we multiply by sampling rate here to correct for scaling
+    }
+    qrm_lap(w, QRM_STAGE_FIT, &t);
+
+//    //normalize amps
+//    for(int i=0; i<w->num_peaks; i++) w->amps[i] /= temp;
+
+        //cook the pitch with a fractional bin analysis
+    for(int i=0; i<w->num_peaks;i++){
+        long ind = w->peaks[i];
+        double f = frac_bin(mag, ind);
+        model[3*i] = f*bw;      //add cooked frequency to output list
+        model[3*i+1] = w->amps[i] / (ref * scale);  //add normalized amplitude to output list;
+        model[3*i+2] = MAX(2.0, ABS(w->dr[i])); //impose a constraint of positive and greater than threshold
+            //catch NaNs in the amplitude or the decay
+        if(model[3*i+1] != model[3*i+1] || model[3*i+2] != model[3*i+2]){
+            model[3*i+1] = 0.0;
+            model[3*i+2] = 10;
+            w->nans++;
+        }
+//        post("qrm: cooked bin %f: (%f Hz)", f, f*bw);
+    }
+    qrm_lap(w, QRM_STAGE_REFINE, &t);
+    return w->num_peaks;
+}
+
+//drop the triples of a band (m of them at model, bins bw Hz wide) that repeat a partial the band below it already
+//found on its own side of their crossover, where it had the finer bins. prev holds that band's np triples.
+//Returns how many are kept, moved down to the front of model.
+long qrm_band_dedupe(const double *prev, long np, double *model, long m, double bw)
+{
+    long n = 0;
+    
+    for(long i=0;i<m;i++){
+        int dup = 0;
+        for(long j=np-1; j>=0 && prev[3*j] > model[3*i] - bw; j--)
+            dup |= ABS(prev[3*j] - model[3*i]) < bw;
+        if(dup) continue;
+        memmove(model + 3*n, model + 3*i, sizeof(double) * 3);
+        n++;
+    }
+    return n;
+}
+
+//analysis points between the attack and w->req.c2, and their offsets from the first one for the fit
+void qrm_slice_positions(t_qrm *x, t_qrm_work *w)
+{
+    long c1 = w->attack;
+    long c2 = w->req.c2;
+//    post("qrm: resetting cursor to attack at index %d", c1);
+    
+    //set analysis points; needs some error checking
+    long ns = x->num_slices;
+//    post("qrm: setting slice indexes at:");
+    for(int i=0;i<ns; i++)
+    {
+        w->slices[i].index_in_buffer = c1 + qrm_slice_offset(x, c2-c1, i);
+//        post("qrm: \t %d", w->slices[i].index_in_buffer);
+        
+        //fit x values are measured from the first slice
+        w->idxs[i]=w->slices[i].index_in_buffer - w->slices[0].index_in_buffer;
+        
+    }
+}
+
+//window win_len samples into each slice's input, in the current precision, and zero-pad it to fft_size; bands
+//above 0 window the start of the same samples, shorter, into band_in. Slice j's samples are src[j][k*stride];
+//each slice is one sweep through its frames. A decimated band 0 is windowed at full length all the same, and
+//qrm_model_fit decimates it, after the samples are let go.
+void qrm_slices_window(t_qrm *x, t_qrm_work *w, const t_float **src, long stride)
+{
+    for(int j=0; j<x->num_slices;j++){
+        const t_float *s = src[j];
+        for(int b=0; b<x->num_bands; b++){
+            const t_qrm_band *bd = &x->band[b];
+            long o = b ? j * x->band_idist + bd->in_off : j * x->slice_idist;
+            long len = b ? bd->win_len : x->win_len;
+            long pad = (b ? bd->fft_size : x->fft_size) - len;
+            if(x->precision == QRM_PRECISION_SINGLE){
+                float *in = (b ? w->fband_in : w->fslice_in) + o;
+                for(long k=0;k<len;k++) in[k] = s[k*stride] * bd->fwindow[k];
+                memset(in + len, 0, sizeof(float) * pad);
+            } else {
+                double *in = (b ? w->band_in : w->slice_in) + o;
+                for(long k=0;k<len;k++) in[k] = s[k*stride] * bd->window[k];
+                memset(in + len, 0, sizeof(double) * pad);
+            }
+        }
+    }
+}
+
+int qrm_analyze(t_qrm *x, t_qrm_work *w)
+{
+    double t = qrm_now();
+    int ok;
+    
+    memset(w->stage_us, 0, sizeof(w->stage_us));
+    w->stages = 0;
+    w->nans = 0;
+    w->track_len = 0;
+    //a result we already have goes out the same way as an analyzed one, in request order, and is not timed
+    w->served = qrm_index_serve(x, w) || qrm_cache_serve(x, w) || qrm_prefetch_serve(x, w);
+    if(w->served)
+        return 1;
+    //a miss is a cacheable request nothing could answer; a prefetch hit is not one
+    if(x->cache_size && w->req.key.buffer && w->req.kind != QRM_REQ_LIVE){
+        systhread_mutex_lock(x->cache_mutex);
+        x->cache_misses++;
+        systhread_mutex_unlock(x->cache_mutex);
+    }
+    if(w->req.kind == QRM_REQ_LIVE)
+        ok = qrm_live_fetch(x, w) && qrm_analyze_list(x, w);
+    else if(w->req.kind == QRM_REQ_LIST)
+        ok = qrm_analyze_list(x, w);
+    else if(w->req.kind == QRM_REQ_CHANNELS)
+        ok = qrm_analyze_channels(x, w);
+    else
+        ok = qrm_analyze_int(x, w);
+    qrm_lap(w, QRM_STAGE_TOTAL, &t);
+    if(ok) qrm_stats_record(x, w);
+    return ok;
+}
+
+//run a request now, or hand it to the worker thread when async is on
+void qrm_submit(t_qrm *x, t_qrm_request *r)
+{
+    t_qrm_work *w;
+
+    systhread_mutex_lock(x->queue_mutex);
+    r->seq = x->next_seq++;
+    x->latest_seq[r->kind] = r->seq;
+    //live regions are never analyzed on the main thread, which is where they are submitted from
+    if(x->async || r->kind == QRM_REQ_LIVE){
+        //latest wins: anything of the same kind still waiting in the queue is now pointless. Not for live regions,
+        //though: every onset is an event of its own, not an older position of the same cursor.
+        if(x->coalesce && r->kind != QRM_REQ_LIVE){
+            long n = 0;
+            for(long i=0;i<x->queue_count;i++){
+                t_qrm_request *q = &x->queue[(x->queue_head + i) % QRM_QUEUE_SIZE];
+                if(q->kind == r->kind) x->dropped++;
+                else x->queue[(x->queue_head + n++) % QRM_QUEUE_SIZE] = *q;
+            }
+            x->queue_count = n;
+        }
+        if(x->queue_count >= QRM_QUEUE_SIZE){
+            systhread_mutex_unlock(x->queue_mutex);
+            object_error((t_object*)x, "request queue is full, dropping request %ld", r->id);
+            return;
+        }
+        x->queue[(x->queue_head + x->queue_count) % QRM_QUEUE_SIZE] = *r;
+        x->queue_count++;
+        systhread_cond_signal(x->queue_cond);
+        systhread_mutex_unlock(x->queue_mutex);
+        return;
+    }
+    systhread_mutex_unlock(x->queue_mutex);
+
+    //synchronous: take the analysis lock with an idle work buffer to write into
+    qrm_analysis_lock(x, 1);
+    systhread_mutex_lock(x->queue_mutex);
+    w = qrm_work_idle(x);
+    systhread_mutex_unlock(x->queue_mutex);
+    w->req = *r;
+    w->ok = qrm_analyze(x, w);
+    if(w->ok) qrm_publish(x, w);
+    systhread_mutex_unlock(x->analysis_mutex);
+
+    //outlets are called without holding any lock, so a patch can feed results straight back in
+    if(w->ok) qrm_output(x);
+}
+
+//take analysis_mutex once at least `idle` work buffers are free. Both can be holding async results that are
+//still waiting for the main thread (e.g. async was just switched off); those are delivered first, with no
+//lock held, since delivering calls the outlets.
+void qrm_analysis_lock(t_qrm *x, long idle)
+{
+    long n;
+    
+    while(1){
+        systhread_mutex_lock(x->analysis_mutex);
+        systhread_mutex_lock(x->queue_mutex);
+        n = !x->work[0].ready + !x->work[1].ready;
+        systhread_mutex_unlock(x->queue_mutex);
+        if(n >= idle) return;
+        systhread_mutex_unlock(x->analysis_mutex);
+        qrm_deliver(x);
+    }
+}
+
+//a work buffer that is not holding an undelivered result. Call with queue_mutex held.
+t_qrm_work *qrm_work_idle(t_qrm *x)
+{
+    for(int i=0;i<2;i++){
+        if(!x->work[i].ready) return &x->work[i];
+    }
+    return NULL;
+}
+
+//copy a finished result into the object's published state (what bang and the outlets read)
+void qrm_publish(t_qrm *x, t_qrm_work *w)
+{
+    x->last_req = w->req;
+    if(w->req.kind != QRM_REQ_INT){
+        memcpy(x->model, w->model, sizeof(double) * w->num_peaks * 3);
+        x->num_model = w->num_peaks;
+        x->region_max_ind = w->attack;
+        x->max_val = w->max_val;
+        x->num_ch = 0;
+        if(w->req.kind == QRM_REQ_CHANNELS){
+            size_t bytes = sizeof(double) * w->nch * (x->fft_size/2) * 3;
+            if(x->ch_alloc < bytes){
+                if(x->ch_models !=NULL) free(x->ch_models);
+                x->ch_models = malloc(bytes);
+                x->ch_alloc = bytes;
             }
+            memcpy(x->ch_models, w->ch_models, bytes);
+            memcpy(x->ch_num, w->ch_num, sizeof(long) * w->nch);
+            memcpy(x->ch_list, w->ch, sizeof(long) * w->nch);
+            x->num_ch = w->nch;
+        }
+    } else {
+        memcpy(x->cooked, w->cooked, sizeof(double) * w->num_peaks * 2);
+        x->num_cooked = w->num_peaks;
+    }
+    if(!w->served) qrm_cache_insert(x, w);
+}
+
+//send the last published result out, right to left: request id, attack index, then the list itself
+void qrm_output(t_qrm *x)
+{
+    double t = qrm_now();
+    
+    outlet_int(x->id_out, x->last_req.id);
+    if(x->last_req.kind != QRM_REQ_INT){
+        outlet_int(x->out, x->region_max_ind);
+        if(x->num_ch)
+            qrm_channels_out(x);
+        else
+            qrm_result_out(x, x->model, x->num_model, 3, x->model_out);     //the (frequency, amplitude, decay) triples
+    } else {
+        qrm_result_out(x, x->cooked, x->num_cooked, 2, x->slice_out);   //the cooked (frequency, amplitude) pairs
+    }
+    //this includes whatever the patch downstream does before the outlet calls return
+    systhread_mutex_lock(x->stats_mutex);
+    qrm_series_push(&x->stats[QRM_STAGE_OUTPUT], qrm_now() - t);
+    systhread_mutex_unlock(x->stats_mutex);
+}
+
+//main thread side of the async path: publish and output every finished result and batch, oldest first
+void qrm_deliver(t_qrm *x)
+{
+    t_qrm_work *w;
+    t_qrm_batch *b;
+
+    while(1){
+        systhread_mutex_lock(x->queue_mutex);
+        w = NULL;
+        for(int i=0;i<2;i++){
+            if(x->work[i].ready && (!w || x->work[i].req.seq < w->req.seq)) w = &x->work[i];
+        }
+        b = x->done_head;
+        if(b && (!w || b->seq < w->req.seq)){
+            x->done_head = b->link;
+            if(!x->done_head) x->done_tail = NULL;
+            systhread_mutex_unlock(x->queue_mutex);
+            qrm_batch_out(x, b);
+            qrm_batch_free(b);
+            free(b);
+            continue;
+        }
+        systhread_mutex_unlock(x->queue_mutex);
+        if(!w) return;
+
+        if(w->ok) qrm_publish(x, w);
+
+        //the buffer is free again as soon as it is published; the worker may already be waiting for it
+        systhread_mutex_lock(x->queue_mutex);
+        w->ready = 0;
+        systhread_cond_signal(x->queue_cond);
+        systhread_mutex_unlock(x->queue_mutex);
+
+        if(w->ok) qrm_output(x);
+    }
+}
+
+//worker thread: take requests in order, analyze into whichever work buffer is idle, then wake the main thread
+void *qrm_worker(t_qrm *x)
+{
+    t_qrm_work *w;
+    t_qrm_request r;
+
+    systhread_mutex_lock(x->queue_mutex);
+    while(!x->worker_quit){
+        w = qrm_work_idle(x);
+        //a batch is analyzed in turn with the requests queued around it; it has its own work buffers
+        if(x->batch_head && (!x->queue_count || x->batch_head->seq < x->queue[x->queue_head].seq)){
+            t_qrm_batch *b = x->batch_head;
+            x->batch_head = b->link;
+            if(!x->batch_head) x->batch_tail = NULL;
+            systhread_mutex_unlock(x->queue_mutex);
+            qrm_batch_analyze(b);
+            systhread_mutex_lock(x->queue_mutex);
+            b->link = NULL;
+            if(x->done_tail) x->done_tail->link = b;
+            else x->done_head = b;
+            x->done_tail = b;
+            qelem_set(x->deliver_qelem);
+            continue;
+        }
+        //nothing to do but prefetch, which has its own work buffer
+        if(!x->queue_count && x->pf_next < x->pf_todo){
+            systhread_mutex_unlock(x->queue_mutex);
+            qrm_prefetch_step(x);
+            systhread_mutex_lock(x->queue_mutex);
+            continue;
+        }
+        if(!x->queue_count || !w){
+            systhread_cond_wait(x->queue_cond, x->queue_mutex);
+            continue;
+        }
+        r = x->queue[x->queue_head];
+        x->queue_head = (x->queue_head + 1) % QRM_QUEUE_SIZE;
+        x->queue_count--;
+        systhread_mutex_unlock(x->queue_mutex);
+
+        //lock order is always analysis_mutex, then queue_mutex
+        systhread_mutex_lock(x->analysis_mutex);
+        w->req = r;
+        w->ok = qrm_analyze(x, w);
+        systhread_mutex_lock(x->queue_mutex);
+        w->ready = 1;
+        systhread_mutex_unlock(x->analysis_mutex);
+        qelem_set(x->deliver_qelem);
+    }
+    systhread_mutex_unlock(x->queue_mutex);
+    systhread_exit(0);
+    return NULL;
+}
+
+void qrm_worker_start(t_qrm *x)
+{
+    if(x->worker) return;
+    x->worker_quit = 0;
+    systhread_create((method)qrm_worker, x, 0, 0, 0, &x->worker);
+}
+
+void qrm_worker_stop(t_qrm *x)
+{
+    unsigned int ret;
+
+    if(!x->worker) return;
+    systhread_mutex_lock(x->queue_mutex);
+    x->worker_quit = 1;
+    systhread_cond_broadcast(x->queue_cond);
+    systhread_mutex_unlock(x->queue_mutex);
+    systhread_join(x->worker, &ret);
+    x->worker = NULL;
+}
+
+//checked between pipeline stages (after the fft, after peak picking): in coalesce mode an analysis whose
+//request has been superseded by a newer one of the same kind is abandoned rather than finished. Live regions are
+//never superseded; each onset gets its model.
+int qrm_stale(t_qrm *x, t_qrm_work *w)
+{
+    //prefetching yields to any real request, and to a newer plan
+    if(w == &x->pf_work)
+        return x->queue_count > 0 || x->batch_head || w->req.seq != x->pf_gen;
+    if(!x->coalesce || w->req.kind == QRM_REQ_LIVE)
+        return 0;
+    systhread_mutex_lock(x->queue_mutex);
+    int stale = w->req.seq < x->latest_seq[w->req.kind];
+    x->dropped += stale;
+    systhread_mutex_unlock(x->queue_mutex);
+    return stale;
+}
+
+//switching coalesce on also restarts the dropped count
+t_max_err qrm_attr_set_coalesce(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    x->coalesce = atom_getlong(argv) != 0;
+    if(x->coalesce) x->dropped = 0;
+    return 0;
+}
+
+//the worker is started the first time async is switched on and then lives as long as the object.
+//switching async off only affects new requests; anything already queued is still analyzed and delivered.
+t_max_err qrm_attr_set_async(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    x->async = atom_getlong(argv) != 0;
+    if(x->async) qrm_worker_start(x);
+    return 0;
+}
+
+
+
+
+void qrm_set(t_qrm *x, t_symbol *s)
+{
+    if (!x->l_buffer_reference)
+        x->l_buffer_reference = buffer_ref_new((t_object *)x, s);
+    else
+        buffer_ref_set(x->l_buffer_reference, s);
+    x->buffer_name = s;
+    qrm_cache_clear(x);
+    qrm_prefetch_clear(x);
+    x->env_dirty = 1;
+    if(x->index) qelem_set(x->index_qelem);
+    
+    //the buffer may have a different sample rate.  Let's find out what it is and reset our SR to match.
+    t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
+    x->sr = buffer_getsamplerate(buffer);
+    long nc = buffer_getchannelcount(buffer);
+    qrm_in1(x,nc);
+}
+
+void qrm_setvsize(t_qrm *x, long n)
+{
+    if(n>0){
+        x->sample_vector_size =n;
+        object_warn((t_object*)x,"Vector size will be set to %d", n);
+    } else {
+        x->sample_vector_size = 1;
+        object_warn((t_object*)x,"Sample Vector Size must be a positive integer. Setting to 1");
+    }
+}
+
+void qrm_getvsize(t_qrm *x)
+{
+    outlet_int(x->out, x->sample_vector_size);
+    object_post((t_object*)x,"Sample Vector Size is %d", x->sample_vector_size);
+}
+
+//fftw is fast at lengths made of small primes; r2c wants an even length for the fft_size/2+1 bins we read
+int qrm_fft_size_ok(long n)
+{
+    if(n < 4 || n > QRM_MAX_FFT_SIZE || n % 2) return 0;
+    while(n % 2 == 0) n /= 2;
+    while(n % 3 == 0) n /= 3;
+    while(n % 5 == 0) n /= 5;
+    while(n % 7 == 0) n /= 7;
+    return n == 1;
+}
+
+void qrm_set_fft_size(t_qrm *x, long n)
+{
+    if(n>0){
+        if(qrm_fft_size_ok(n)){
+            //results still waiting in the work buffers were computed at the old size; send them on first,
+            //and make sure nothing is analyzing while we swap the buffers out from under it
+            qrm_analysis_lock(x, 2);
+            x->fft_size = n;
+            qrm_win_update(x);
             
+            //swap to the shared plans for the new fft size
+            qrm_plans_update(x);
+            
+            //re-carve the window, the published results and the work buffers for the new size
+            qrm_arena_update(x);
+            hann_window_gen(x);
+            x->num_cooked = 0;
+            x->num_model = 0;
+            systhread_mutex_unlock(x->analysis_mutex);
+            //the index is only served at the fft size it was built with
+            if(x->index) qelem_set(x->index_qelem);
 
             object_post((t_object*)x,"FFT size set to %d", n);
             
         } else {
-            object_error((t_object*)x,"FFT size must be a power of 2");
+            object_error((t_object*)x,"FFT size must be an even number from 4 to %d with no prime factors above 7", QRM_MAX_FFT_SIZE);
         }
     } else {
         object_error((t_object*)x,"FFT size must be a positive integer");
     }
 }
 
+//the window is at most the fft; a shorter one is zero-padded, for finer bins than its length alone would give
+void qrm_win_update(t_qrm *x)
+{
+    x->win_len = x->window_size > 0 ? MIN(x->window_size, x->fft_size) : x->fft_size;
+    qrm_bands_layout(x);
+}
+
+//a band for each crossover, each above the first at half the transform and window of the one below. Bands that
+//would come out shorter than QRM_MIN_BAND_FFT, or odd, are left off, and the last one kept runs up to Nyquist.
+//Every band's window in band_in starts 64-byte aligned within a slice's stretch of it, for the band plans.
+//Band 0 only has to reach the first crossover, so it is decimated by the largest power of two that keeps the
+//crossover within half its new Nyquist (the half-band filters' passband, at the object's sample rate) and its
+//transform at least QRM_MIN_BAND_FFT. Its bins stay fft_size's width; there are just fewer of them. The bands above
+//add up to 1/2, 3/4 or 7/8 of fft_size with one, two or three crossovers, so the transforms together come to less
+//than fft_size once decim is above 2, 4 or 8 respectively: a first crossover under sr/8, sr/16 or sr/32.
+//Higher ones still cost more than a single analysis; what bands buy is accuracy, high partials fitted from windows
+//short enough not to smear their decays while the lows keep fft_size's resolution.
+void qrm_bands_layout(t_qrm *x)
+{
+    long nb = 1, off = 0, bins = 0;
+    
+    while(nb <= x->num_cuts && nb < QRM_MAX_BANDS && (x->fft_size >> nb) >= QRM_MIN_BAND_FFT && qrm_fft_size_ok(x->fft_size >> nb))
+        nb++;
+    x->num_bands = nb;
+    for(int b=0; b<nb; b++){
+        t_qrm_band *bd = &x->band[b];
+        bd->decim = 1;
+        for(long d=2; !b && nb > 1 && x->band_cuts[0] <= x->sr / (4*d) && x->fft_size % d == 0 && x->fft_size / d >= QRM_MIN_BAND_FFT; d*=2)
+            bd->decim = d;
+        bd->fft_size = (x->fft_size >> b) / bd->decim;
+        bd->win_len = bd->decim > 1 ? bd->fft_size : MAX(2, x->win_len >> b);
+        bd->scale = bd->decim > 1 ? 1.0 / bd->decim : (double)bd->win_len / x->win_len;
+        bd->lo = b ? x->band_cuts[b-1] : 0;
+        bd->hi = b < nb-1 ? x->band_cuts[b] : 0;
+        bd->in_off = off;
+        if(b || bd->decim > 1) off += (bd->fft_size + 15) & ~15L;
+        bd->mag_off = bins;
+        bins += bd->fft_size/2 + 1;
+    }
+    x->band_idist = off;
+    x->band_bins = bins;
+}
+
+//crossovers change the band plans and work buffers, so they are set like the fft size
+t_max_err qrm_attr_set_bands(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = (argc && argv) ? *argc : 0;
+    long nc = 0;
+    
+    qrm_analysis_lock(x, 2);
+    for(long i=0; i<MIN(n, QRM_MAX_BANDS-1); i++){
+        double f = atom_getfloat(argv + i);
+        if(f > 0 && (!nc || f > x->band_cuts[nc-1])) x->band_cuts[nc++] = f;
+    }
+    if(nc < n) object_warn((t_object*)x, "bands takes up to %d ascending crossover frequencies; using %ld", QRM_MAX_BANDS-1, nc);
+    x->num_cuts = nc;
+    qrm_win_update(x);
+    if(x->num_bands <= nc)
+        object_warn((t_object*)x, "fft size %ld only leaves room for %ld bands", x->fft_size, x->num_bands);
+    qrm_plans_update(x);
+    qrm_arena_update(x);
+    hann_window_gen(x);
+    x->num_cooked = 0;
+    x->num_model = 0;
+    systhread_mutex_unlock(x->analysis_mutex);
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+t_max_err qrm_attr_get_bands(t_qrm *x, t_object *attr, long *argc, t_atom **argv)
+{
+    char alloc;
+    
+    atom_alloc_array(MAX(1, x->num_cuts), argc, argv, &alloc);
+    *argc = x->num_cuts;
+    for(long i=0;i<x->num_cuts;i++) atom_setfloat(*argv + i, x->band_cuts[i]);
+    return 0;
+}
+
+t_max_err qrm_attr_set_window_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = MAX(0, atom_getlong(argv));
+    
+    if(n == 1 || n > x->fft_size)
+        object_warn((t_object*)x, "window size must be from 2 to the fft size (%ld)", x->fft_size);
+    qrm_analysis_lock(x, 2);
+    x->window_size = n == 1 ? 2 : n;
+    qrm_win_update(x);
+    hann_window_gen(x);
+    x->num_cooked = 0;
+    x->num_model = 0;
+    systhread_mutex_unlock(x->analysis_mutex);
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
 t_max_err qrm_attr_set_fft_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
 {
     qrm_set_fft_size(x, atom_getlong(argv));
@@ -683,21 +2235,124 @@ t_max_err qrm_attr_get_fft_size(t_qrm *x, t_object *attr, long *argc, t_atom **a
     return 0;
 }
 
+//like the fft size, the slice count sets the layout of the slice plans and work buffers
+void qrm_set_num_slices(t_qrm *x, long n)
+{
+    n = CLAMP(n, QRM_MIN_SLICES, QRM_MAX_SLICES);
+    if(n == x->num_slices) return;
+    qrm_analysis_lock(x, 2);
+    x->num_slices = n;
+    qrm_plans_update(x);
+    qrm_arena_update(x);
+    hann_window_gen(x);
+    x->num_cooked = 0;
+    x->num_model = 0;
+    systhread_mutex_unlock(x->analysis_mutex);
+    if(x->index) qelem_set(x->index_qelem);
+}
+
+//precision changes the plans and the layout of the work buffers too
+t_max_err qrm_attr_set_precision(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = CLAMP(atom_getlong(argv), QRM_PRECISION_DOUBLE, QRM_PRECISION_SINGLE);
+    
+    if(n == x->precision) return 0;
+    qrm_analysis_lock(x, 2);
+    x->precision = n;
+    qrm_plans_update(x);
+    qrm_arena_update(x);
+    hann_window_gen(x);
+    x->num_cooked = 0;
+    x->num_model = 0;
+    systhread_mutex_unlock(x->analysis_mutex);
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+//tracking fits many more points than there are slices, so switching to or from it lays the work buffers out again
+t_max_err qrm_attr_set_decay_eval(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = CLAMP(atom_getlong(argv), QRM_DECAY_AUTO, QRM_DECAY_TRACK);
+    
+    if(n == x->decay_eval) return 0;
+    qrm_analysis_lock(x, 2);
+    x->decay_eval = n;
+    qrm_arena_update(x);
+    hann_window_gen(x);
+    x->num_cooked = 0;
+    x->num_model = 0;
+    systhread_mutex_unlock(x->analysis_mutex);
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+t_max_err qrm_attr_set_num_slices(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    qrm_set_num_slices(x, atom_getlong(argv));
+    return 0;
+}
+
+t_max_err qrm_attr_set_slice_spacing(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    x->slice_spacing = CLAMP(atom_getlong(argv), QRM_SPACING_UNIFORM, QRM_SPACING_LOG);
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+t_max_err qrm_attr_set_max_partials(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = MAX(0, atom_getlong(argv));
+    
+    if(n == x->max_partials) return 0;
+    x->max_partials = n;
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+t_max_err qrm_attr_set_partial_tol(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    double tol = MAX(0.0, atom_getfloat(argv));
+    
+    if(tol == x->partial_tol) return 0;
+    x->partial_tol = tol;
+    if(x->index) qelem_set(x->index_qelem);
+    return 0;
+}
+
+//offset of analysis point i from the attack, for a region span samples long. Log spacing puts point i at
+//(span+1)^(i/(n-1)) - 1, so the points crowd in where the partials are still changing quickly.
+long qrm_slice_offset(t_qrm *x, long span, long i)
+{
+    long n = x->num_slices;
+    
+    if(x->slice_spacing == QRM_SPACING_LOG)
+        return (long)(pow(span + 1.0, (double)i / (n-1)) - 1.0);
+    return i * (span / (n-1));
+}
+
 
 
 
 
 void qrm_in1(t_qrm *x, long n)
 {
+    long chan = x->l_chan;
+    
     if (n)
         x->l_chan = MAX(n, 1) - 1;
     else
         x->l_chan = 0;
+    //the index only holds models of the channel it was built from
+    if(x->index && x->l_chan != chan) qelem_set(x->index_qelem);
 }
 
 
 void qrm_dsp64(t_qrm *x, t_object *dsp64, short *count, double samplerate, long maxvectorsize, long flags)
 {
+    //live mode records from the start of every dsp run, at the current sample rate
+    systhread_mutex_lock(x->analysis_mutex);
+    if(x->live || x->ring) qrm_live_ring_alloc(x, samplerate);
+    systhread_mutex_unlock(x->analysis_mutex);
     dsp_add64(dsp64, (t_object *)x, (t_perfroutine64)qrm_perform64, 0, NULL);
 }
 
@@ -712,14 +2367,16 @@ void qrm_assist(t_qrm *x, void *b, long m, long a, char *s)
 {
     if (m == ASSIST_OUTLET)
         switch(a){
-            case 0: sprintf(s,"(signal) Placeholder for impulse function"); break;
+            case 0: sprintf(s,"(signal) Placeholder for impulse function (silent in live mode)"); break;
             case 1: sprintf(s,"Slice Out (list)"); break;
-            case 2: sprintf(s,"Model Out (list)"); break;
+            case 2: sprintf(s,"Model Out (list), channel <n> models"); break;
             case 3: sprintf(s,"Buffer Index of Attack (int)"); break;
+            case 4: sprintf(s,"Request ID of the Following Result (int)"); break;
+            case 5: sprintf(s,"Info Out: <stage>, peaks and nans messages from stats"); break;
         }
     else if(m==ASSIST_INLET) {
         switch (a) {
-        case 0:    sprintf(s,"(signal) Sample Index");    break;
+        case 0:    sprintf(s,"(signal) Sample Index, or Audio Input in live mode");    break;
         case 1:    sprintf(s,"Audio Channel In buffer~");    break;
         }
     }
@@ -728,6 +2385,7 @@ void qrm_assist(t_qrm *x, void *b, long m, long a, char *s)
 void qrm_set_thresh(t_qrm *x, double n)
 {
     if(n<=0){
+        if(x->index && n != x->thresh) qelem_set(x->index_qelem);
         x->thresh = n;
         object_post((t_object*)x,"qrm: Threshold set to %f dB relative to peak value.", n);
     } else {
@@ -765,71 +2423,152 @@ void qrm_bang(t_qrm *x)
     //        atom_setfloat(myList+i,theNumbers[i]);
     //    }
     //    outlet_list(x->d_out, 0L, 3, &myList);
-    qrm_list_out(x, x->cooked, x->num_peaks*2, x->slice_out);     //list the cooked frequencies out the left outlet
-    qrm_list_out(x, x->model, x->num_peaks * 3, x->model_out);    //list the most recent model out the second left outlet
+    qrm_result_out(x, x->cooked, x->num_cooked, 2, x->slice_out);     //list the cooked frequencies out the left outlet
+    qrm_result_out(x, x->model, x->num_model, 3, x->model_out);    //list the most recent model out the second left outlet
 }
 
+//list out at most num_atoms values, using the atoms carved for it rather than the stack
 void qrm_list_out(t_qrm *x, double* a, long l, void* outlet)
 {
-    t_atom list[l];
+    l = MIN(l, x->num_atoms);
     for(int i = 0; i<l; i++){
-        atom_setfloat(list+i, a[i]);
+        atom_setfloat(x->atoms+i, a[i]);
     }
-    outlet_list(outlet, 0L, l, list);
+    outlet_list(outlet, 0L, (short)l, x->atoms);
 }
 
-void *qrm_new(t_symbol *s, long argc, t_atom* argv)
+//num tuples of width values, either into the sink buffer~ followed by "sink <name> <count>", or as a list.
+//a list longer than an outlet can carry loses its last tuples, with a warning.
+void qrm_result_out(t_qrm *x, double *a, long num, long width, void *outlet)
 {
-    t_qrm *x = object_alloc(qrm_class);
-    dsp_setup((t_pxobject *)x, 1);
-    intin((t_object *)x,1);
-    x->out = outlet_new((t_object *)x, "int");  //right outlet
-//    x->f_out = outlet_new((t_object *)x, "float");
-    x->model_out = outlet_new((t_object *)x, NULL); //outlet for models
-    x->slice_out = outlet_new((t_object *)x, NULL);     //outlet for slices
-    outlet_new((t_object *)x, "signal");        //left outlet
-    qrm_set(x, atom_getsym(argv));
-    qrm_in1(x, 0);                              //default to left channel
-    x->sr = sys_getsr();                        //initially, adopt the system sample rate. We will reset later.
-    post("qrm: SR = %d", (int)x->sr);
-    x->fft_size = 4096;
+    t_atom note[2];
+    long rows;
     
-    x->in = (double *) fftw_malloc(sizeof(double) * (x->fft_size));
-    x->outs = (double *) fftw_malloc(sizeof(double) * (x->fft_size)*2);     //output is twice the size of input since we are going real->complex
-    memset(x->in, '\0', x->fft_size * sizeof(double));  //initialize to zero
-    memset(x->outs, '\0', x->fft_size * 2 * sizeof(double));
-    x->p = fftw_plan_dft_r2c_1d((int)x->fft_size, x->in, (fftw_complex *)x->outs, FFTW_MEASURE); //plan for sinusoidal model extraction
-    x->mag_spec = malloc(sizeof(double)*(x->fft_size));     //these could be half as long
-    x->phase_spec = malloc(sizeof(double)*(x->fft_size));
-    x->peaks = malloc(sizeof(long) * (x->fft_size / 2));
-    x->cooked = malloc(sizeof(double) * (x->fft_size));
-    x->model = malloc(sizeof(double) * (x->fft_size * 3));
-    x->analysis_points = malloc(sizeof(long) * 5);      //we are going to analyze just 5 points to extract decay rates
-    x->ap0 = malloc(sizeof(double) * x->fft_size / 2);
-    x->ap1 = malloc(sizeof(double) * x->fft_size / 2);
-    x->ap2 = malloc(sizeof(double) * x->fft_size / 2);
-    x->ap3 = malloc(sizeof(double) * x->fft_size / 2);
-    x->ap4 = malloc(sizeof(double) * x->fft_size / 2);
-    x->idxs = malloc(sizeof(long) * NUMSLICES);
-    x->tempY = malloc(sizeof(double) * NUMSLICES);
-    x->tempAB = malloc(sizeof(double) * 2);
-    x->amps = malloc(sizeof(double) * x->fft_size);
-    x->dr = malloc(sizeof(double) * x->fft_size);
-    
-    //allocate slice fft plans and input/output buffers
-    for(int i=0;i<NUMSLICES;i++){
-        x->slices[i].in = (double *) fftw_malloc(sizeof(double) * (x->fft_size));
-        x->slices[i].outs = (double *) fftw_malloc(sizeof(double) * (x->fft_size)*2);
-        memset(x->slices[i].in, '\0', x->fft_size * sizeof(double));  //initialize to zero
-        memset(x->slices[i].outs, '\0', x->fft_size * 2 * sizeof(double));
-        x->slices[i].p = fftw_plan_dft_r2c_1d((int)x->fft_size, x->slices[i].in, (fftw_complex *)x->slices[i].outs, FFTW_MEASURE);
-        x->slices[i].mag_spec = malloc(sizeof(double)*x->fft_size);
-        x->slices[i].phase_spec = malloc(sizeof(double)*x->fft_size);
+    if(x->sink_ref && x->sink != gensym("")){
+        rows = qrm_sink_write(x, a, num, width);
+        if(rows < 0) return;
+        atom_setsym(note, x->sink);
+        atom_setlong(note + 1, rows);
+        outlet_anything(outlet, gensym("sink"), 2, note);
+        return;
     }
+    if(num * width > x->num_atoms){
+        object_warn((t_object*)x, "%ld partials do not fit in a list, sending the first %ld", num, x->num_atoms / width);
+        num = x->num_atoms / width;
+    }
+    qrm_list_out(x, a, num * width, outlet);
+}
+
+//write num rows of (frequency, amplitude[, decay]) into the sink, one column per channel and one row per frame.
+//frames past the last row are zero, so readers can tell where the model ends: only the rows the previous result
+//used are cleared, the whole buffer~ just the first time. Returns the rows written, -1 if the buffer~ is not there
+//or is the one being analyzed.
+long qrm_sink_write(t_qrm *x, double *a, long num, long width)
+{
+    t_buffer_obj *buffer = buffer_ref_getobject(x->sink_ref);
+    t_float *tab;
+    
+    if(buffer && buffer == buffer_ref_getobject(x->l_buffer_reference)){
+        object_error((t_object*)x, "sink buffer~ %s is the buffer~ being analyzed", x->sink->s_name);
+        return -1;
+    }
+    if(!buffer || !(tab = buffer_locksamples(buffer))){
+        object_error((t_object*)x, "sink buffer~ %s not found", x->sink->s_name);
+        return -1;
+    }
+    long frames = buffer_getframecount(buffer);
+    long nc = buffer_getchannelcount(buffer);
+    long rows = MIN(num, frames);
+    long cols = MIN(width, nc);
+    long used = x->sink_rows < 0 ? frames : MIN(x->sink_rows, frames);
+    if(rows < num)
+        object_warn((t_object*)x, "sink buffer~ %s holds %ld of %ld partials", x->sink->s_name, rows, num);
+    //a row is written across every channel: an int result after a list one leaves no stale decay column behind
+    for(long i=0;i<rows;i++){
+        for(long j=0;j<nc;j++)
+            tab[i*nc+j] = j < cols ? a[i*width+j] : 0;
+    }
+    if(used > rows)
+        memset(tab + rows*nc, 0, sizeof(t_float) * (used - rows) * nc);
+    x->sink_rows = rows;
+    buffer_unlocksamples(buffer);
+    buffer_setdirty(buffer);
+    return rows;
+}
+
+t_max_err qrm_attr_set_sink(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    t_symbol *s = (argc && *argc) ? atom_getsym(argv) : gensym("");
+    
+    //results written into the analyzed buffer~ would be analyzed next, and would clear the cache on every write
+    if(s != gensym("") && s == x->buffer_name){
+        object_error((t_object*)x, "sink cannot be the buffer~ being analyzed (%s)", s->s_name);
+        return MAX_ERR_GENERIC;
+    }
+    x->sink_rows = -1;
+    if(!x->sink_ref)
+        x->sink_ref = buffer_ref_new((t_object *)x, s);
+    else
+        buffer_ref_set(x->sink_ref, s);
+    x->sink = s;
+    return 0;
+}
+
+void *qrm_new(t_symbol *s, long argc, t_atom* argv)
+{
+    t_qrm *x = object_alloc(qrm_class);
+    dsp_setup((t_pxobject *)x, 1);
+    intin((t_object *)x,1);
+    x->info_out = outlet_new((t_object *)x, NULL);  //rightmost outlet, for stats
+    x->id_out = outlet_new((t_object *)x, "int");
+    x->out = outlet_new((t_object *)x, "int");
+//    x->f_out = outlet_new((t_object *)x, "float");
+    x->model_out = outlet_new((t_object *)x, NULL); //outlet for models
+    x->slice_out = outlet_new((t_object *)x, NULL);     //outlet for slices
+    outlet_new((t_object *)x, "signal");        //left outlet
+    
+    //locks first: qrm_set already clears the cache and the prefetch ring under them
+    systhread_mutex_new(&x->analysis_mutex, 0);
+    systhread_mutex_new(&x->queue_mutex, 0);
+    systhread_cond_new(&x->queue_cond, 0);
+    systhread_mutex_new(&x->cache_mutex, 0);
+    systhread_mutex_new(&x->env_mutex, 0);
+    systhread_mutex_new(&x->stats_mutex, 0);
+    qrm_set(x, atom_getsym(argv));
+    qrm_in1(x, 0);                              //default to left channel
+    x->sr = sys_getsr();                        //initially, adopt the system sample rate. We will reset later.
+    post("qrm: SR = %d", (int)x->sr);
+    x->fft_size = 4096;
+    qrm_win_update(x);
+    x->num_slices = NUMSLICES;
+    
+    qrm_plans_update(x);                        //plans for sinusoidal model extraction and the decay slices
+    
+    //window, published results and the per-request scratch buffers, all in one arena
+    qrm_arena_update(x);
+
+    //async machinery; the worker thread itself is only started when async is switched on
+    x->deliver_qelem = qelem_new(x, (method)qrm_deliver);
+    x->next_id = 1;
+    
+    //live mode; the ring buffer is only allocated once live is switched on
+    x->live_qelem = qelem_new(x, (method)qrm_live_drain);
+    x->live_sr = x->sr;
+    x->live_region = 500;
+    x->live_thresh = -40;
+    x->live_pending = -1;
+    qrm_live_update(x);
+    x->index_qelem = qelem_new(x, (method)qrm_index_start);
+    x->pf_qelem = qelem_new(x, (method)qrm_prefetch_idle);
+    x->prefetch_tol = 256;
+    x->cache_size = 1024;
+    x->envelope = 1;
+    x->sink = gensym("");
+    x->sink_rows = -1;
     
     x->thresh = -32;
-    x->num_peaks = 0;
-    x->window_function = malloc(sizeof(double)*((int)x->fft_size));
+    x->num_cooked = 0;
+    x->num_model = 0;
     hann_window_gen(x);
     attr_args_process(x, (short)argc, argv);
     
@@ -862,129 +2601,1820 @@ void *qrm_new(t_symbol *s, long argc, t_atom* argv)
 void qrm_free(t_qrm *x)
 {
     dsp_free((t_pxobject *)x);
-    fftw_destroy_plan(x->p);
-    for(int i=0;i<5;i++){
-        fftw_destroy_plan(x->slices[i].p);
-        if(x->slices[i].mag_spec !=NULL) free(x->slices[i].mag_spec);
-        if(x->slices[i].phase_spec !=NULL) free(x->slices[i].phase_spec);
-    }
-    if(x->in != NULL) fftw_free((char *)x->in);
-    if(x->outs !=NULL) fftw_free((char *)x->outs);
-    if(x->mag_spec !=NULL) free(x->mag_spec);
-    if(x->phase_spec !=NULL) free(x->phase_spec);
-    if(x->peaks !=NULL) free(x->peaks);
-    if(x->cooked !=NULL) free(x->cooked);
-    if(x->model !=NULL) free(x->model);
-    if(x->idxs !=NULL) free(x->idxs);
-    if(x->tempY !=NULL) free(x->tempY);
-    if(x->tempAB !=NULL) free(x->tempAB);
-    if(x->amps !=NULL) free(x->amps);
-    if(x->dr !=NULL) free(x->dr);
-    
-    if(x->window_function !=NULL) free(x->window_function);
-    if(x->analysis_points !=NULL) free(x->analysis_points);
-    if(x->ap0 !=NULL) free(x->ap0);
-    if(x->ap1 !=NULL) free(x->ap1);
-    if(x->ap2 !=NULL) free(x->ap2);
-    if(x->ap3 !=NULL) free(x->ap3);
-    if(x->ap4 !=NULL) free(x->ap4);
+    qrm_worker_stop(x);
+    qelem_free(x->deliver_qelem);
+    //batches the worker never got to, or that were never delivered
+    for(int l=0;l<2;l++){
+        t_qrm_batch *b = l ? x->done_head : x->batch_head;
+        while(b){
+            t_qrm_batch *next = b->link;
+            qrm_batch_free(b);
+            free(b);
+            b = next;
+        }
+    }
+    qelem_free(x->live_qelem);
+    qelem_free(x->index_qelem);
+    qelem_free(x->pf_qelem);
+    //a running build finishes, but does not start over
+    systhread_mutex_lock(x->queue_mutex);
+    x->index_again = 0;
+    systhread_mutex_unlock(x->queue_mutex);
+    if(x->index_thread){
+        unsigned int ret;
+        systhread_join(x->index_thread, &ret);
+    }
+    qrm_prefetch_clear(x);
+    qrm_work_free(&x->pf_work);
+    qrm_index_free(x);
+    qrm_bank_unmap(&x->bank);
+    qrm_cache_clear(x);
+    systhread_mutex_free(x->cache_mutex);
+    qrm_env_free(x);
+    systhread_mutex_free(x->env_mutex);
+    systhread_mutex_free(x->stats_mutex);
+    if(x->ring !=NULL) sysmem_freeptr(x->ring);
+    systhread_cond_free(x->queue_cond);
+    systhread_mutex_free(x->queue_mutex);
+    systhread_mutex_free(x->analysis_mutex);
+
+    qrm_band_plans_release(x);
+    if(x->p !=NULL) qrm_plan_release(x->p);
+    if(x->slice_plan !=NULL) qrm_plan_release(x->slice_plan);
+    if(x->decay_plan !=NULL) qrm_plan_release(x->decay_plan);
+    for(int i=0;i<2;i++) qrm_work_free(&x->work[i]);
+    if(x->arena !=NULL) fftw_free(x->arena);
+    if(x->ch_models !=NULL) free(x->ch_models);
+    if(x->sink_ref) object_free(x->sink_ref);
     object_free(x->l_buffer_reference);
 }
 
 
 t_max_err qrm_notify(t_qrm *x, t_symbol *s, t_symbol *msg, void *sender, void *data)
 {
+    //buffer contents changed: cached models are wrong now, and the index needs rebuilding once things have settled.
+    //our own writes to the sink do not count.
+    if(x->sink_ref)
+        buffer_ref_notify(x->sink_ref, s, msg, sender, data);
+    if(msg == gensym("buffer_modified") && !(x->sink_ref && sender == buffer_ref_getobject(x->sink_ref))){
+        qrm_cache_clear(x);
+        qrm_prefetch_clear(x);
+        x->env_dirty = 1;
+        if(x->index) qelem_set(x->index_qelem);
+    }
     return buffer_ref_notify(x->l_buffer_reference, s, msg, sender, data);
 }
 
-//TODO: need to rethink this function to scale with multiple ffts
-//hann_window function
-void hann_window(t_qrm *x, double *a){
-    for(int i=0;i<x->fft_size;i++){
-        a[i] *= pow(sin(PI*i / x->fft_size),2);
+void *qrm_carve(t_qrm_carve *c, size_t bytes)
+{
+    void *p = c->base ? c->base + c->used : NULL;
+    
+    c->used += (bytes + 63) & ~(size_t)63;
+    return p;
+}
+
+//lay one request's worth of scratch state out in c, sized exactly for the current fft_size and num_slices.
+//spectra are fft_size/2+1 bins, results at most fft_size/2 peaks. Slice windows are one block: inputs packed
+//slice_idist apart, outputs packed slice_odist complex bins apart, matching the layout of x->slice_plan.
+void qrm_work_carve(t_qrm *x, t_qrm_work *w, t_qrm_carve *c)
+{
+    long nbins = x->fft_size/2 + 1;
+    long npeaks = x->fft_size/2;
+    long ns = x->num_slices;
+    long nd = x->precision == QRM_PRECISION_DOUBLE;     //which of the fft blocks get any room
+    long nf = !nd;
+    
+    w->in = qrm_carve(c, sizeof(double) * x->fft_size * nd);
+    w->outs = qrm_carve(c, sizeof(fftw_complex) * nbins * nd);
+    w->fin = qrm_carve(c, sizeof(float) * x->fft_size * nf);
+    w->fouts = qrm_carve(c, sizeof(fftwf_complex) * nbins * nf);
+    w->fmag = qrm_carve(c, sizeof(float) * MAX(nbins, x->band_bins) * nf);
+    w->mag_spec = qrm_carve(c, sizeof(double) * nbins);
+    w->peaks = qrm_carve(c, sizeof(long) * npeaks);
+    w->cooked = qrm_carve(c, sizeof(double) * npeaks * 2);
+    w->model = qrm_carve(c, sizeof(double) * npeaks * 3);
+    w->amps = qrm_carve(c, sizeof(double) * npeaks);
+    w->dr = qrm_carve(c, sizeof(double) * npeaks);
+    w->slice_in = qrm_carve(c, sizeof(double) * x->slice_idist * ns * nd);
+    w->slice_outs = qrm_carve(c, sizeof(fftw_complex) * x->slice_odist * ns * nd);
+    w->fslice_in = qrm_carve(c, sizeof(float) * x->slice_idist * ns * nf);
+    w->fslice_outs = qrm_carve(c, sizeof(fftwf_complex) * x->slice_odist * ns * nf);
+    w->band_in = qrm_carve(c, sizeof(double) * x->band_idist * ns * nd);
+    w->fband_in = qrm_carve(c, sizeof(float) * x->band_idist * ns * nf);
+    w->fit_y = qrm_carve(c, sizeof(double) * (x->decay_eval == QRM_DECAY_TRACK ? MAX(ns, QRM_TRACK_POINTS) : ns) * QRM_FIT_BLOCK);
+    w->track_state = qrm_carve(c, sizeof(double) * 18 * QRM_FIT_BLOCK * (x->decay_eval == QRM_DECAY_TRACK));
+    w->fit_sums = qrm_carve(c, sizeof(double) * 5 * QRM_FIT_BLOCK);
+    //only slice 0 has its spectrum worked out, each band's end to end; the others are only read at the peak bins,
+    //straight into fit_y
+    w->slices[0].mag_spec = qrm_carve(c, sizeof(double) * x->band_bins);
+    if(!c->base) return;
+    for(int i=0;i<ns;i++){
+        w->slices[i].in = w->slice_in + i * x->slice_idist;
+        w->slices[i].outs = w->slice_outs + i * 2 * x->slice_odist;
+        w->slices[i].fin = w->fslice_in + i * x->slice_idist;
+        w->slices[i].fouts = w->fslice_outs + i * 2 * x->slice_odist;
     }
 }
 
-void hann_window_gen(t_qrm *x)
+//the object's window, published results and both work buffers. Call with the analysis lock held and no
+//undelivered results, since the work buffers are laid out again from scratch.
+void qrm_arena_carve(t_qrm *x, t_qrm_carve *c)
 {
-    for(int i=0;i<x->fft_size;i++){
-        x->window_function[i] = pow(sin(PI*i / x->fft_size),2);
+    x->window_function = qrm_carve(c, sizeof(double) * x->fft_size);
+    x->fwindow = qrm_carve(c, sizeof(float) * x->fft_size);
+    x->band[0].window = x->window_function;
+    x->band[0].fwindow = x->fwindow;
+    for(int b=1; b<x->num_bands; b++){
+        x->band[b].window = qrm_carve(c, sizeof(double) * x->band[b].fft_size);
+        x->band[b].fwindow = qrm_carve(c, sizeof(float) * x->band[b].fft_size);
     }
+    x->cooked = qrm_carve(c, sizeof(double) * x->fft_size);
+    x->model = qrm_carve(c, sizeof(double) * (x->fft_size/2) * 3);
+    x->num_atoms = MIN((x->fft_size/2) * 3, QRM_MAX_LIST_ATOMS);
+    x->atoms = qrm_carve(c, sizeof(t_atom) * x->num_atoms);
+    for(int i=0;i<2;i++) qrm_work_carve(x, &x->work[i], c);
 }
 
-//method to perform exponential fitting via least squares
-//the bias term 'wt' allows for weighting the initial value to ensure closer approximation of amplitude
-void exp_fit(long *xVals, double *yVals, long n, double* out, double wt)
+//size the object's arena for the current fft_size and num_slices and carve it up. The arena is only ever
+//grown; going down in size reuses what is already there.
+void qrm_arena_update(t_qrm *x)
 {
-//    double *out = malloc(sizeof(double)*2);
-    out[0] =0;
-    out[1] = 0;
-    double sum_Y=0;
-    double sum_XY=0;
-    double sum_X2Y=0;
-    double sum_YlnY=0;
-    double sum_XYlnY=0;
-    double bias = wt;
+    t_qrm_carve c = {NULL, 0};
     
-    for(int i=0;i<n;i++){
-        if(i==0 || i==n-1){ bias=wt;}else{bias = 1.0;}
-        double XY = bias*(double)(xVals[i] * yVals[i]);
-        double X2Y = bias*((double)xVals[i]) * XY;
-        double YlnY = bias*(yVals[i] * log(yVals[i]));
-        double XYlnY = bias*(double)xVals[i] * YlnY;
-        
-        sum_Y += bias*yVals[i];
-        sum_XY += XY;
-        sum_X2Y += X2Y;
-        sum_YlnY += YlnY;
-        sum_XYlnY += XYlnY;
+    qrm_arena_carve(x, &c);
+    if(x->arena_size < c.used){
+        if(x->arena !=NULL) fftw_free(x->arena);
+        x->arena = fftw_malloc(c.used);
+        x->arena_size = c.used;
+    }
+    memset(x->arena, 0, c.used);
+    c.base = x->arena;
+    c.used = 0;
+    qrm_arena_carve(x, &c);
+    for(int i=0;i<2;i++) x->work[i].ready = 0;
+    x->footprint = (long)x->arena_size;
+    x->layout_gen++;
+}
+
+//a work buffer that lives on its own (batch threads), in an arena of its own
+void qrm_work_alloc(t_qrm *x, t_qrm_work *w)
+{
+    t_qrm_carve c = {NULL, 0};
+    
+    qrm_work_carve(x, w, &c);
+    if(w->arena_size < c.used){
+        if(w->arena !=NULL) fftw_free(w->arena);
+        w->arena = fftw_malloc(c.used);
+        w->arena_size = c.used;
+    }
+    memset(w->arena, 0, c.used);
+    c.base = w->arena;
+    c.used = 0;
+    qrm_work_carve(x, w, &c);
+    w->ready = 0;
+}
+
+void qrm_work_free(t_qrm_work *w)
+{
+    if(w->arena !=NULL) fftw_free(w->arena);
+    if(w->live !=NULL) free(w->live);
+    if(w->track_buf !=NULL) free(w->track_buf);
+    if(w->multi !=NULL) fftw_free(w->multi);
+    memset(w, 0, sizeof(t_qrm_work));
+}
+
+//swap to the shared plans for the current fft_size and bands. Another instance may already have built them;
+//otherwise they are planned once with the current planner rigor (and wisdom, if we have any).
+void qrm_plans_update(t_qrm *x)
+{
+    //fft_size/2+1 bins, rounded up so every slice's output starts on a 64-byte boundary: 4 double or 8 float bins.
+    //slices 1.. are transformed on their own by decay_plan, so they must be as aligned as the start of the block;
+    //the inputs likewise, which matters once fft_size is not a power of two.
+    char precision = x->precision == QRM_PRECISION_SINGLE ? 'f' : 'd';
+    if(precision == 'f')
+        x->slice_odist = (x->fft_size/2 + 8) & ~7L;
+    else
+        x->slice_odist = (x->fft_size/2 + 4) & ~3L;
+    x->slice_idist = (x->fft_size + 15) & ~15L;
+    
+    qrm_band_plans_release(x);
+    if(x->p !=NULL) qrm_plan_release(x->p);
+    x->p = qrm_plan_acquire(x->fft_size, 1, x->fft_size, x->fft_size/2 + 1, precision);
+    if(x->slice_plan !=NULL) qrm_plan_release(x->slice_plan);
+    x->slice_plan = qrm_plan_acquire(x->fft_size, x->num_slices, x->slice_idist, x->slice_odist, precision);
+    if(x->decay_plan !=NULL) qrm_plan_release(x->decay_plan);
+    x->decay_plan = qrm_plan_acquire(x->fft_size, x->num_slices-1, x->slice_idist, x->slice_odist, precision);
+    x->band[0].p = x->p;
+    x->band[0].decay_plan = x->decay_plan;
+    
+    //the bands in band_in write the slice block, whose outputs are far enough apart for any of them. Slice 0 goes
+    //through p on its own, so only the object's own slice_plan ever transforms every slice at once.
+    for(int b=0; b<x->num_bands; b++){
+        t_qrm_band *bd = &x->band[b];
+        if(!b && bd->decim == 1) continue;
+        bd->p = qrm_plan_acquire(bd->fft_size, 1, bd->fft_size, bd->fft_size/2 + 1, precision);
+        bd->decay_plan = qrm_plan_acquire(bd->fft_size, x->num_slices-1, x->band_idist, x->slice_odist, precision);
+    }
+}
+
+//the bands' own plans: every one above band 0, and band 0's when it is decimated; undecimated, it has the object's
+void qrm_band_plans_release(t_qrm *x)
+{
+    for(int b=0; b<QRM_MAX_BANDS; b++){
+        t_qrm_band *bd = &x->band[b];
+        if(bd->p !=NULL && bd->p != x->p) qrm_plan_release(bd->p);
+        if(bd->decay_plan !=NULL && bd->decay_plan != x->decay_plan) qrm_plan_release(bd->decay_plan);
+        bd->p = bd->decay_plan = NULL;
+    }
+}
+
+//find or build a shared r2c plan for howmany transforms of length size, inputs idist samples apart and outputs
+//odist complex bins apart. Planning happens on scratch arrays, since FFTW_MEASURE and up overwrite their arrays;
+//callers execute with fftw_execute_dft_r2c (precision 'd') or fftwf_execute_dft_r2c ('f') on their own
+//arrays of the same layout and alignment.
+t_qrm_plan *qrm_plan_acquire(long size, long howmany, long idist, long odist, char precision)
+{
+    t_qrm_plan *plan;
+    int n = (int)size;
+    
+    systhread_mutex_lock(qrm_plans_mutex);
+    for(plan = qrm_plans; plan; plan = plan->next){
+        if(plan->size == size && plan->precision == precision && plan->howmany == howmany && plan->idist == idist && plan->odist == odist){
+            plan->refcount++;
+            systhread_mutex_unlock(qrm_plans_mutex);
+            return plan;
+        }
+    }
+    
+    plan = malloc(sizeof(t_qrm_plan));
+    plan->size = size;
+    plan->precision = precision;
+    plan->howmany = howmany;
+    plan->idist = idist;
+    plan->odist = odist;
+    plan->refcount = 1;
+    plan->p = NULL;
+    plan->pf = NULL;
+    if(precision == 'f'){
+        float *in = (float *) fftwf_malloc(sizeof(float) * idist * howmany);
+        fftwf_complex *out = (fftwf_complex *) fftwf_malloc(sizeof(fftwf_complex) * odist * howmany);
+        plan->pf = fftwf_plan_many_dft_r2c(1, &n, (int)howmany, in, NULL, 1, (int)idist, out, NULL, 1, (int)odist, qrm_planner_flags);
+        fftwf_free(in);
+        fftwf_free(out);
+    } else {
+        double *in = (double *) fftw_malloc(sizeof(double) * idist * howmany);
+        fftw_complex *out = (fftw_complex *) fftw_malloc(sizeof(fftw_complex) * odist * howmany);
+        plan->p = fftw_plan_many_dft_r2c(1, &n, (int)howmany, in, NULL, 1, (int)idist, out, NULL, 1, (int)odist, qrm_planner_flags);
+        fftw_free(in);
+        fftw_free(out);
+    }
+    plan->next = qrm_plans;
+    qrm_plans = plan;
+    
+    //anything new we measured is worth keeping for the next session
+    if(qrm_planner_flags != FFTW_ESTIMATE) qrm_wisdom_export();
+    systhread_mutex_unlock(qrm_plans_mutex);
+    return plan;
+}
+
+void qrm_plan_release(t_qrm_plan *plan)
+{
+    t_qrm_plan **pp;
+    
+    systhread_mutex_lock(qrm_plans_mutex);
+    if(--plan->refcount <= 0){
+        for(pp = &qrm_plans; *pp; pp = &(*pp)->next){
+            if(*pp == plan){
+                *pp = plan->next;
+                break;
+            }
+        }
+        if(plan->pf) fftwf_destroy_plan(plan->pf);
+        if(plan->p) fftw_destroy_plan(plan->p);
+        free(plan);
     }
-//    post("qrm:XY: %f, %f, %f, %f, %f", sum_Y, sum_XY, sum_X2Y, sum_YlnY, sum_XYlnY);
+    systhread_mutex_unlock(qrm_plans_mutex);
+}
+
+//wisdom lives in the per-user cache folder unless the wisdom attribute points somewhere else
+void qrm_wisdom_default_path(char *path, size_t len)
+{
+#ifdef WIN_VERSION
+    const char *dir = getenv("LOCALAPPDATA");
+    snprintf(path, len, "%s\\qrm~.fftw_wisdom", dir ? dir : ".");
+#else
+    const char *dir = getenv("HOME");
+    snprintf(path, len, "%s/Library/Caches/qrm~.fftw_wisdom", dir ? dir : ".");
+#endif
+}
+
+//fftwf keeps wisdom of its own; it goes next to the double precision file, with .single on the end
+void qrm_wisdom_import(void)
+{
+    char fpath[MAX_PATH_CHARS + 8];
+    
+    if(!qrm_wisdom_path[0]) return;
+    if(fftw_import_wisdom_from_filename(qrm_wisdom_path))
+        post("qrm: loaded fftw wisdom from %s", qrm_wisdom_path);
+    snprintf(fpath, sizeof(fpath), "%s.single", qrm_wisdom_path);
+    fftwf_import_wisdom_from_filename(fpath);
+}
+
+//must be called with qrm_plans_mutex held; the fftw planner is not thread-safe
+void qrm_wisdom_export(void)
+{
+    char fpath[MAX_PATH_CHARS + 8];
     
-    double den = sum_Y * sum_X2Y - sum_XY * sum_XY + EPSILON;
+    if(!qrm_wisdom_path[0]) return;
+    if(!fftw_export_wisdom_to_filename(qrm_wisdom_path))
+        error("qrm: could not write fftw wisdom to %s", qrm_wisdom_path);
+    snprintf(fpath, sizeof(fpath), "%s.single", qrm_wisdom_path);
+    fftwf_export_wisdom_to_filename(fpath);
+}
+
+t_max_err qrm_attr_set_wisdom(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    t_symbol *path = (argc && *argc) ? atom_getsym(argv) : gensym("");
     
-    out[0] = exp((sum_X2Y * sum_YlnY - sum_XY * sum_XYlnY)/(den));
-    out[1] = (sum_Y * sum_XYlnY - sum_XY * sum_YlnY)/(den);
+    systhread_mutex_lock(qrm_plans_mutex);
+    strncpy(qrm_wisdom_path, path->s_name, sizeof(qrm_wisdom_path) - 1);
+    qrm_wisdom_path[sizeof(qrm_wisdom_path) - 1] = '\0';
+    //merge whatever is already stored there, then write back everything we know
+    qrm_wisdom_import();
+    qrm_wisdom_export();
+    systhread_mutex_unlock(qrm_plans_mutex);
+    x->wisdom = path;
+    return 0;
+}
+
+t_max_err qrm_attr_get_wisdom(t_qrm *x, t_object *attr, long *argc, t_atom **argv)
+{
+    char alloc;
+    atom_alloc(argc, argv, &alloc);
+    atom_setsym(*argv, gensym(qrm_wisdom_path));
+    return 0;
+}
+
+//planning rigor applies to plans built from now on; plans already shared keep the rigor they were built with
+t_max_err qrm_attr_set_planner(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    t_symbol *s = atom_getsym(argv);
     
-//    post("%f", out[0]);
-//    post("%f", out[1]);
-//    return out;
+    if(s == gensym("estimate")) qrm_planner_flags = FFTW_ESTIMATE;
+    else if(s == gensym("measure")) qrm_planner_flags = FFTW_MEASURE;
+    else if(s == gensym("patient")) qrm_planner_flags = FFTW_PATIENT;
+    else {
+        object_error((t_object*)x, "planner must be one of estimate, measure or patient");
+        return MAX_ERR_GENERIC;
+    }
+    x->planner = s;
+    return 0;
+}
+
+t_max_err qrm_attr_get_planner(t_qrm *x, t_object *attr, long *argc, t_atom **argv)
+{
+    char alloc;
+    atom_alloc(argc, argv, &alloc);
+    if(qrm_planner_flags == FFTW_ESTIMATE) atom_setsym(*argv, gensym("estimate"));
+    else if(qrm_planner_flags == FFTW_PATIENT) atom_setsym(*argv, gensym("patient"));
+    else atom_setsym(*argv, gensym("measure"));
+    return 0;
 }
 
-void findMaxInBuffer(t_qrm* x){
+void hann_window_gen(t_qrm *x)
+{
+    hann_fill(x->window_function, x->fwindow, x->win_len);
+    for(int b=1; b<x->num_bands; b++)
+        hann_fill(x->band[b].window, x->band[b].fwindow, x->band[b].win_len);
+}
+
+//find the loudest sample in w->req.c1..c2; that is where the attack is, and where the model analysis starts
+int findMaxInBuffer(t_qrm* x, t_qrm_work *w){
     t_float *tab;
-    t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
-    x->sr = buffer_getsamplerate(buffer);
-    tab = buffer_locksamples(buffer);
+    long frames, nc, chan;
+    tab = qrm_samples_lock(x, w, &frames, &nc, &chan);
     if(!tab){
         goto zero;
     }
     //get buffer length. If window at cursor exceeds buffer length, truncate window.
-    long frames = buffer_getframecount(buffer);
-    long i = x->cursor + x->fft_size;
-    i = MIN(x->cursor, frames - x->fft_size);
+    long i = w->req.c1 + x->fft_size;
+    i = MIN(w->req.c1, frames - x->fft_size);
     
-    //get channels
-    long nc = buffer_getchannelcount(buffer);
-    long chan = MIN(x->l_chan, nc);
-    
-    x->region_max_ind = x->cursor;
-    x->max_val = 0.0;
-    double t = 0;
-    //start at the end and work back
-    for(long j = x->cursor; j< x->cursor2;j++){
-        t = ABS(tab[(j)*nc+chan]);
-        if(t > x->max_val){
-            x->max_val = t;
-            x->region_max_ind = j;
-        };
-        
+    w->attack = w->req.c1;
+    w->max_val = 0.0;
+    //two passes: the largest |sample| first, then where it first occurs. Wide regions in the buffer~ go through
+    //the envelope pyramid (built the first time it is needed, and again after the buffer changes), which only
+    //looks at the samples of the blocks at the edges and of the block holding the attack.
+    long c1 = w->req.c1, c2 = w->req.c2;
+    if(x->envelope && w->req.kind != QRM_REQ_LIVE && c2 - c1 >= QRM_ENV_BLOCK * QRM_ENV_FANOUT){
+        systhread_mutex_lock(x->env_mutex);
+        if(!x->env_levels || x->env_dirty || x->env_frames != frames || x->env_nc != nc || x->env_chan != chan)
+            qrm_env_build(x, tab, frames, nc, chan);
+        w->max_val = qrm_env_max(x, tab, nc, chan, c1, c2);
+        if(w->max_val > 0) w->attack = qrm_env_find(x, tab, nc, chan, c1, c2, w->max_val);
+        systhread_mutex_unlock(x->env_mutex);
+    } else if(c2 > c1){
+        w->max_val = qrm_abs_max(tab + c1*nc + chan, c2 - c1, nc);
+        for(long j = c1; j< c2 && w->max_val > 0;j++){
+            if(ABS(tab[(j)*nc+chan]) == w->max_val){
+                w->attack = j;
+                break;
+            }
+        }
     }
-    buffer_unlocksamples(buffer);
-    return;
+    qrm_samples_unlock(x, w);
+    return 1;
     
 zero:
 //    outlet_float(x->f_out, 0.0);
     object_error((t_object*)x,"qrm:findMaxInBuffer: Error: did not get buffer.");
+    return 0;
+}
+
+//where a region request's samples come from: the buffer~ (locked until qrm_samples_unlock), or for live requests
+//the copy qrm_live_fetch already took out of the ring. Sets w->sr to match.
+t_float *qrm_samples_lock(t_qrm *x, t_qrm_work *w, long *frames, long *nc, long *chan)
+{
+    t_float *tab;
+    
+    if(w->req.kind == QRM_REQ_LIVE){
+        w->sr = x->live_sr;
+        *frames = w->live_frames;
+        *nc = 1;
+        *chan = 0;
+        return w->live;
+    }
+    t_buffer_obj    *buffer = buffer_ref_getobject(x->l_buffer_reference);
+    w->sr = buffer_getsamplerate(buffer);
+    tab = buffer_locksamples(buffer);
+    if(!tab)
+        return NULL;
+    w->lock_t = qrm_now();
+    *frames = buffer_getframecount(buffer);
+    *nc = buffer_getchannelcount(buffer);
+    *chan = MIN(x->l_chan, *nc);
+    return tab;
+}
+
+void qrm_samples_unlock(t_qrm *x, t_qrm_work *w)
+{
+    if(w->req.kind != QRM_REQ_LIVE){
+        buffer_unlocksamples(buffer_ref_getobject(x->l_buffer_reference));
+        qrm_lap(w, QRM_STAGE_LOCK, &w->lock_t);
+    }
+}
+
+//audio thread side of live mode: record into the ring, follow a fast and a slow envelope, and call it an onset
+//when the fast one jumps above the slow one. Once the region after an onset (plus one fft frame) is recorded it
+//is queued for the main thread. Nothing here blocks or allocates.
+void qrm_live_perform(t_qrm *x, double *in, double *out, long n)
+{
+    float *ring = x->ring;
+    long mask = x->ring_size - 1;
+    long long pos = x->ring_pos;
+    double fast = x->env_fast, slow = x->env_slow;
+    
+    for(long i=0;i<n;i++,pos++){
+        ring[pos & mask] = in[i];
+        if(qrm_onset_detect(fabs(in[i]), &fast, &slow, x->env_fast_coef, x->env_slow_coef, x->live_floor) && x->live_pending < 0 && pos >= x->live_hold){
+            x->live_pending = MAX(0, pos - QRM_ONSET_PREROLL);
+            x->live_pending_len = x->live_region_samps;
+            x->live_hold = x->live_pending + x->live_pending_len;   //one region at a time
+        }
+        if(x->live_pending >= 0 && pos + 1 >= x->live_pending + x->live_pending_len + x->win_len){
+            long head = atomic_load_explicit(&x->live_head, memory_order_relaxed);
+            if(head - atomic_load_explicit(&x->live_tail, memory_order_acquire) < QRM_LIVE_SLOTS){
+                x->live_onsets[head % QRM_LIVE_SLOTS].start = x->live_pending;
+                x->live_onsets[head % QRM_LIVE_SLOTS].len = x->live_pending_len;
+                atomic_store_explicit(&x->live_head, head + 1, memory_order_release);
+            }
+            x->live_pending = -1;
+        }
+        out[i] = 0.0;
+    }
+    x->env_fast = fast;
+    x->env_slow = slow;
+    x->ring_pos = pos;
+    atomic_store_explicit(&x->ring_written, pos, memory_order_release);
+    if(atomic_load_explicit(&x->live_head, memory_order_relaxed) != atomic_load_explicit(&x->live_tail, memory_order_relaxed))
+        qelem_set(x->live_qelem);
+}
+
+//one sample of the onset detector: follow a fast and a slow envelope of a, and report whether the fast one
+//has jumped above the slow one
+int qrm_onset_detect(double a, double *fast, double *slow, double fast_coef, double slow_coef, double floor)
+{
+    *fast += (a - *fast) * fast_coef;
+    *slow += (a - *slow) * slow_coef;
+    return *fast > floor && *fast > QRM_ONSET_RATIO * *slow;
+}
+
+//main thread: turn every onset the audio thread has queued into a live request for the worker
+void qrm_live_drain(t_qrm *x)
+{
+    long tail = atomic_load_explicit(&x->live_tail, memory_order_relaxed);
+    t_qrm_request r;
+    
+    while(tail != atomic_load_explicit(&x->live_head, memory_order_acquire)){
+        r.kind = QRM_REQ_LIVE;
+        r.id = x->next_id++;
+        r.origin = x->live_onsets[tail % QRM_LIVE_SLOTS].start;
+        r.c1 = 0;
+        r.c2 = x->live_onsets[tail % QRM_LIVE_SLOTS].len;
+        r.key.buffer = NULL;    //never the same region twice
+        atomic_store_explicit(&x->live_tail, ++tail, memory_order_release);
+        qrm_submit(x, &r);
+    }
+}
+
+//worker thread: copy a live request's region out of the ring so the rest of the pipeline can treat it like a
+//mono buffer~. The audio thread keeps writing meanwhile; if it has come round to the region again the copy is torn.
+int qrm_live_fetch(t_qrm *x, t_qrm_work *w)
+{
+    long len = w->req.c2 + x->win_len;
+    long long start = w->req.origin;
+    long mask = x->ring_size - 1;
+    
+    if(!x->ring || len > x->ring_size || atomic_load_explicit(&x->ring_written, memory_order_acquire) < start + len){
+        object_warn((t_object*)x, "live region at %lld is no longer available", start);
+        return 0;
+    }
+    if(w->live_alloc < len){
+        if(w->live !=NULL) free(w->live);
+        w->live = malloc(sizeof(t_float) * len);
+        w->live_alloc = len;
+    }
+    for(long i=0;i<len;i++)
+        w->live[i] = x->ring[(start + i) & mask];
+    if(atomic_load_explicit(&x->ring_written, memory_order_acquire) - start > x->ring_size){
+        object_warn((t_object*)x, "live region at %lld was overwritten before it could be analyzed", start);
+        return 0;
+    }
+    w->live_frames = len;
+    return 1;
+}
+
+//the ring holds the longest region plus the largest fft twice over, so the worker has at least that long to copy
+//a region out. Called with analysis_mutex held, from dsp64 or when live is switched on.
+void qrm_live_ring_alloc(t_qrm *x, double sr)
+{
+    long need = 2 * (long)(QRM_LIVE_MAX_REGION * 0.001 * sr + QRM_MAX_FFT_SIZE);
+    long size = 1;
+    
+    while(size < need) size <<= 1;
+    if(x->ring == NULL || x->ring_size != size){
+        if(x->ring !=NULL) sysmem_freeptr(x->ring);
+        x->ring = (float *)sysmem_newptrclear(sizeof(float) * size);
+        x->ring_size = size;
+    }
+    x->live_sr = sr;
+    x->ring_pos = 0;
+    atomic_store(&x->ring_written, 0);
+    x->env_fast = 0;
+    x->env_slow = 0;
+    x->live_hold = 0;
+    x->live_pending = -1;
+    qrm_live_update(x);
+}
+
+//derive what the audio thread uses from the live attributes and the dsp sample rate
+void qrm_live_update(t_qrm *x)
+{
+    x->live_region_samps = (long)(x->live_region * 0.001 * x->live_sr);
+    x->live_floor = pow(10.0, x->live_thresh / 20.0);
+    x->env_fast_coef = 1.0 - exp(-1.0 / (QRM_ONSET_FAST * x->live_sr));
+    x->env_slow_coef = 1.0 - exp(-1.0 / (QRM_ONSET_SLOW * x->live_sr));
+}
+
+//live results are analyzed on the worker, so switching live on starts it. If dsp is already running the ring is
+//allocated here; recording then starts with the next vector.
+t_max_err qrm_attr_set_live(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    char live = atom_getlong(argv) != 0;
+    
+    if(live){
+        qrm_worker_start(x);
+        if(!x->ring){
+            systhread_mutex_lock(x->analysis_mutex);
+            qrm_live_ring_alloc(x, x->live_sr);
+            systhread_mutex_unlock(x->analysis_mutex);
+        }
+    }
+    x->live = live;
+    return 0;
+}
+
+t_max_err qrm_attr_set_live_region(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    x->live_region = CLAMP(atom_getfloat(argv), 10.0, QRM_LIVE_MAX_REGION);
+    qrm_live_update(x);
+    return 0;
+}
+
+t_max_err qrm_attr_set_live_thresh(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    x->live_thresh = MIN(atom_getfloat(argv), 0.0);
+    qrm_live_update(x);
+    return 0;
+}
+
+//scan the whole buffer for onsets and model every one of them, so later int and list messages can be answered
+//from the table instead of by analysis
+void qrm_analyze_all(t_qrm *x)
+{
+    qrm_index_start(x);
+}
+
+void qrm_clear_index(t_qrm *x)
+{
+    qelem_unset(x->index_qelem);
+    systhread_mutex_lock(x->queue_mutex);
+    x->index_again = 0;
+    systhread_mutex_unlock(x->queue_mutex);
+    systhread_mutex_lock(x->analysis_mutex);
+    x->index_gen++;
+    qrm_index_free(x);
+    systhread_mutex_unlock(x->analysis_mutex);
+}
+
+//(re)build the index on its own thread; one build at a time, and a request for another while one runs starts a
+//new one as soon as it is done
+void qrm_index_start(t_qrm *x)
+{
+    unsigned int ret;
+    
+    systhread_mutex_lock(x->queue_mutex);
+    if(x->index_busy){
+        x->index_again = 1;
+        systhread_mutex_unlock(x->queue_mutex);
+        return;
+    }
+    x->index_busy = 1;
+    systhread_mutex_unlock(x->queue_mutex);
+    //the last build is done, but its thread still needs joining
+    if(x->index_thread) systhread_join(x->index_thread, &ret);
+    systhread_create((method)qrm_index_thread, x, 0, 0, 0, &x->index_thread);
+}
+
+void *qrm_index_thread(t_qrm *x)
+{
+    while(1){
+        qrm_index_build(x);
+        systhread_mutex_lock(x->queue_mutex);
+        if(!x->index_again){
+            x->index_busy = 0;
+            systhread_mutex_unlock(x->queue_mutex);
+            break;
+        }
+        x->index_again = 0;
+        systhread_mutex_unlock(x->queue_mutex);
+    }
+    systhread_exit(0);
+    return NULL;
+}
+
+//build the onset index; runs on the index thread. Onset detection runs over the whole buffer every time, it is
+//cheap; the models are the expensive part, so an onset whose region is unchanged and whose samples hash the same
+//as last time keeps its model. The rest are analyzed in parallel, like a batch. Only taking the settings, reusing
+//the old models and publishing the new index hold analysis_mutex; the analyses lock it like any batch.
+void qrm_index_build(t_qrm *x)
+{
+    t_buffer_obj *buffer = buffer_ref_getobject(x->l_buffer_reference);
+    t_float *tab;
+    t_qrm_index_entry *e;
+    t_qrm_batch b;
+    t_qrm_request k;
+    long cap = 64, n = 0, reused = 0, gen;
+    
+    //the settings this build is for. If they change while it runs, another build is already queued and this
+    //index is published with the old settings, which no request then matches.
+    systhread_mutex_lock(x->analysis_mutex);
+    memset(&k, 0, sizeof(t_qrm_request));
+    qrm_cache_key(x, &k);
+    gen = x->index_gen;
+    systhread_mutex_unlock(x->analysis_mutex);
+    
+    tab = buffer ? buffer_locksamples(buffer) : NULL;
+    if(!tab){
+        object_error((t_object*)x,"analyze_all: did not get buffer");
+        return;
+    }
+    long frames = buffer_getframecount(buffer);
+    long nc = buffer_getchannelcount(buffer);
+    long chan = MIN(k.key.chan, nc);
+    double sr = buffer_getsamplerate(buffer);
+    long last = frames - 1 - k.key.win_len;   //latest region end with a window after it
+    k.key.chan = chan;
+    
+    long nblocks = (frames + QRM_INDEX_BLOCK - 1) / QRM_INDEX_BLOCK;
+    unsigned long long *hash = malloc(sizeof(unsigned long long) * MAX(1, nblocks));
+    for(long i=0;i<nblocks;i++)
+        hash[i] = qrm_block_hash(tab, i * QRM_INDEX_BLOCK, MIN(QRM_INDEX_BLOCK, frames - i * QRM_INDEX_BLOCK), nc, chan);
+    
+    //onsets, with the same detector live mode uses
+    double fast = 0, slow = 0;
+    double fast_coef = 1.0 - exp(-1.0 / (QRM_ONSET_FAST * sr));
+    double slow_coef = 1.0 - exp(-1.0 / (QRM_ONSET_SLOW * sr));
+    long hold = 0;
+    e = malloc(sizeof(t_qrm_index_entry) * cap);
+    for(long j=0;j<=last;j++){
+        if(qrm_onset_detect(fabs(tab[j*nc+chan]), &fast, &slow, fast_coef, slow_coef, x->live_floor) && j >= hold){
+            if(n == cap){
+                cap *= 2;
+                e = realloc(e, sizeof(t_qrm_index_entry) * cap);
+            }
+            e[n].start = MAX(0, j - QRM_ONSET_PREROLL);
+            e[n].model = NULL;
+            e[n].num = 0;
+            n++;
+            hold = j + (long)(QRM_ONSET_HOLD * sr);
+        }
+    }
+    buffer_unlocksamples(buffer);
+    for(long i=0;i<n;i++)
+        e[i].end = (i+1 < n) ? e[i+1].start : last;
+    
+    //keep (copies of) the models of onsets that have not moved and whose samples have not changed, if the old
+    //index was built with the same settings; queue the rest
+    qrm_batch_init(&b, x, n);
+    b.count = 0;
+    systhread_mutex_lock(x->analysis_mutex);
+    int same = x->index && frames == x->index_frames && nc == x->index_nc && qrm_index_matches(x, &k.key);
+    for(long i=0, j=0;i<n;i++){
+        while(j < x->index_count && x->index[j].start < e[i].start) j++;
+        if(same && j < x->index_count && x->index[j].start == e[i].start && x->index[j].end == e[i].end){
+            long lo = e[i].start / QRM_INDEX_BLOCK;
+            long hi = MIN(nblocks - 1, (e[i].end + k.key.win_len) / QRM_INDEX_BLOCK);
+            long changed = 0;
+            for(long c=lo;c<=hi;c++) changed |= hash[c] != x->index_hash[c];
+            if(!changed){
+                e[i] = x->index[j];
+                if(e[i].model){
+                    e[i].model = malloc(sizeof(double) * MAX(1, e[i].num * 3));
+                    memcpy(e[i].model, x->index[j].model, sizeof(double) * e[i].num * 3);
+                }
+                reused++;
+                continue;
+            }
+        }
+        b.reqs[b.count].kind = QRM_REQ_LIST;
+        b.reqs[b.count].id = i;
+        b.reqs[b.count].c1 = e[i].start;
+        b.reqs[b.count].c2 = e[i].end;
+        b.count++;
+    }
+    systhread_mutex_unlock(x->analysis_mutex);
+    qrm_batch_analyze(&b);
+    for(long j=0;j<b.count;j++){
+        t_qrm_index_entry *f = e + b.reqs[j].id;
+        f->attack = b.ok[j] ? b.attack[j] : f->start;
+        f->peak = b.ok[j] ? b.max_val[j] : 0;
+        f->model = b.models[j];
+        f->num = b.num[j];
+        b.models[j] = NULL;
+    }
+    qrm_batch_free(&b);
+    
+    //requests read the index under analysis_mutex, from the worker thread too
+    systhread_mutex_lock(x->analysis_mutex);
+    if(gen != x->index_gen){
+        //cleared while we ran
+        systhread_mutex_unlock(x->analysis_mutex);
+        for(long i=0;i<n;i++){
+            if(e[i].model !=NULL) free(e[i].model);
+        }
+        free(e);
+        free(hash);
+        return;
+    }
+    qrm_index_free(x);
+    x->index = e;
+    x->index_count = n;
+    x->index_hash = hash;
+    x->index_blocks = nblocks;
+    x->index_frames = frames;
+    x->index_nc = nc;
+    memcpy(&x->index_key, &k.key, sizeof(t_qrm_cache_key));
+    systhread_mutex_unlock(x->analysis_mutex);
+    object_post((t_object*)x,"indexed %ld onsets (%ld analyzed, %ld unchanged)", n, n - reused, reused);
+}
+
+void qrm_index_free(t_qrm *x)
+{
+    for(long i=0;i<x->index_count;i++){
+        if(x->index[i].model !=NULL) free(x->index[i].model);
+    }
+    if(x->index !=NULL) free(x->index);
+    if(x->index_hash !=NULL) free(x->index_hash);
+    x->index = NULL;
+    x->index_hash = NULL;
+    x->index_count = 0;
+    x->index_blocks = 0;
+}
+
+//whether the index was built from the buffer~ and with every setting its models depend on that k has. k->chan is
+//the channel asked for, which the buffer~ may not have; the index holds the channel it was clamped to.
+int qrm_index_matches(t_qrm *x, const t_qrm_cache_key *k)
+{
+    t_qrm_cache_key m;
+    
+    memcpy(&m, k, sizeof(t_qrm_cache_key));
+    m.chan = MIN(k->chan, x->index_nc);
+    m.kind = 0;
+    m.c1 = m.c2 = 0;
+    return !memcmp(&m, &x->index_key, sizeof(t_qrm_cache_key));
+}
+
+//answer w->req from the index instead of analyzing: a list gets the first onset inside c1..c2, an int the onset
+//nearest c1. Returns 0, and the request is analyzed as usual, when there is no index for the request's settings
+//or a list has no onset inside it. Called with analysis_mutex held, which the index is swapped under.
+int qrm_index_serve(t_qrm *x, t_qrm_work *w)
+{
+    t_qrm_request *r = &w->req;
+    t_qrm_index_entry *e;
+    long lo = 0, hi = x->index_count, i;
+    
+    if((r->kind != QRM_REQ_INT && r->kind != QRM_REQ_LIST) || !r->key.buffer)
+        return 0;
+    if(!x->index || !x->index_count || !qrm_index_matches(x, &r->key))
+        return 0;
+    //first onset at or after c1
+    while(lo < hi){
+        long mid = (lo + hi) / 2;
+        if(x->index[mid].start < r->c1) lo = mid + 1;
+        else hi = mid;
+    }
+    if(r->kind == QRM_REQ_LIST){
+        if(lo == x->index_count || x->index[lo].start > r->c2)
+            return 0;
+        i = lo;
+    } else if(lo == x->index_count || (lo > 0 && r->c1 - x->index[lo-1].start < x->index[lo].start - r->c1))
+        i = lo - 1;
+    else
+        i = lo;
+    e = x->index + i;
+    if(!e->model)
+        return 0;
+    
+    if(r->kind == QRM_REQ_LIST){
+        memcpy(w->model, e->model, sizeof(double) * e->num * 3);
+        w->attack = e->attack;
+        w->max_val = e->peak;
+    } else {
+        //the (frequency, amplitude) part of the onset's model
+        for(long k=0;k<e->num;k++){
+            w->cooked[2*k] = e->model[3*k];
+            w->cooked[2*k+1] = e->model[3*k+1];
+        }
+    }
+    w->num_peaks = (int)e->num;
+    return 1;
 }
 
+//write <path>: every model of the onset index (or, without one, the last list model) into a model bank.
+//It goes to <path>.tmp first and is renamed over path, so a bank this or another object has mapped stays valid.
+void qrm_write(t_qrm *x, t_symbol *path)
+{
+    t_qrm_bank_header h;
+    t_qrm_bank_entry *ents;
+    t_qrm_index_entry last;
+    const t_qrm_index_entry *src;
+    char file[MAX_PATH_CHARS], tmp[MAX_PATH_CHARS + 8];
+    long count, ok = 1;
+    uint64_t total = 0, pos;
+    FILE *f;
+    static const char zeros[QRM_BANK_ALIGNMENT];
+    
+    if(!path || !path->s_name[0]){
+        object_error((t_object*)x, "write needs a file path");
+        return;
+    }
+    if(!qrm_bank_path(path, 1, file)){
+        object_error((t_object*)x, "write: could not resolve %s", path->s_name);
+        return;
+    }
+    //the index thread may be swapping in a new index
+    systhread_mutex_lock(x->analysis_mutex);
+    if(x->index && x->index_count){
+        src = x->index;
+        count = x->index_count;
+    } else if(x->num_model){
+        last.start = x->last_req.c1;
+        last.end = x->last_req.c2;
+        last.attack = x->region_max_ind;
+        last.peak = x->max_val;
+        last.model = x->model;
+        last.num = x->num_model;
+        src = &last;
+        count = 1;
+    } else {
+        systhread_mutex_unlock(x->analysis_mutex);
+        object_error((t_object*)x, "write: no models yet (send a list, or analyze_all)");
+        return;
+    }
+    
+    ents = calloc(count, sizeof(t_qrm_bank_entry));
+    for(long i=0;i<count;i++){
+        t_qrm_bank_entry *e = ents + i;
+        long indexed = src == x->index;
+        e->start = src[i].start;
+        e->end = src[i].end;
+        e->attack = src[i].attack;
+        e->peak = src[i].peak;
+        e->first = total;
+        e->num = src[i].model ? (uint32_t)src[i].num : 0;
+        e->fft_size = (int32_t)(indexed ? x->index_key.fft_size : x->fft_size);
+        e->win_len = (int32_t)(indexed ? x->index_key.win_len : x->win_len);
+        e->slices = (int32_t)(indexed ? x->index_key.num_slices : x->num_slices);
+        e->bands = (int32_t)(indexed ? x->index_key.num_bands : x->num_bands);
+        e->precision = (int32_t)(indexed ? x->index_key.precision : x->precision);
+        e->chan = (int32_t)(indexed ? x->index_key.chan : x->l_chan);
+        e->max_partials = (int32_t)(indexed ? x->index_key.max_partials : x->max_partials);
+        e->thresh = (float)(indexed ? x->index_key.thresh : x->thresh);
+        e->partial_tol = (float)(indexed ? x->index_key.partial_tol : x->partial_tol);
+        total += e->num;
+    }
+    
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, QRM_BANK_MAGIC, 4);
+    h.version = QRM_BANK_VERSION;
+    h.entry_size = sizeof(t_qrm_bank_entry);
+    h.count = (uint32_t)count;
+    h.partials = total;
+    h.sr = x->sr;
+    h.entries = sizeof(h);
+    h.freqs = QRM_BANK_ALIGN(h.entries + sizeof(t_qrm_bank_entry) * count);
+    h.amps = QRM_BANK_ALIGN(h.freqs + sizeof(float) * total);
+    h.decays = QRM_BANK_ALIGN(h.amps + sizeof(float) * total);
+    h.size = QRM_BANK_ALIGN(h.decays + sizeof(float) * total);
+    
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    f = fopen(tmp, "wb");
+    if(!f){
+        systhread_mutex_unlock(x->analysis_mutex);
+        object_error((t_object*)x, "write: could not open %s", tmp);
+        free(ents);
+        return;
+    }
+    ok &= fwrite(&h, sizeof(h), 1, f) == 1;
+    ok &= fwrite(ents, sizeof(t_qrm_bank_entry), count, f) == (size_t)count;
+    pos = h.entries + sizeof(t_qrm_bank_entry) * count;
+    //the three columns, each starting on a QRM_BANK_ALIGNMENT boundary: frequencies, then amplitudes, then decays
+    for(int col=0;col<3 && ok;col++){
+        uint64_t at = col == 0 ? h.freqs : (col == 1 ? h.amps : h.decays);
+        float v[256];
+        long n = 0;
+        
+        ok &= fwrite(zeros, 1, at - pos, f) == at - pos;
+        for(long i=0;i<count && ok;i++){
+            for(long k=0;k<ents[i].num;k++){
+                v[n++] = (float)src[i].model[3*k+col];
+                if(n == 256){
+                    ok &= fwrite(v, sizeof(float), n, f) == (size_t)n;
+                    n = 0;
+                }
+            }
+        }
+        if(n) ok &= fwrite(v, sizeof(float), n, f) == (size_t)n;
+        pos = at + sizeof(float) * total;
+    }
+    ok &= fwrite(zeros, 1, h.size - pos, f) == h.size - pos;
+    systhread_mutex_unlock(x->analysis_mutex);
+    free(ents);
+    if(fclose(f) || !ok){
+        object_error((t_object*)x, "write: could not write %s", tmp);
+        remove(tmp);
+        return;
+    }
+#ifdef WIN_VERSION
+    remove(file);
+#endif
+    if(rename(tmp, file)){
+        object_error((t_object*)x, "write: could not replace %s", file);
+        remove(tmp);
+        return;
+    }
+    post("qrm: wrote %ld models to %s", count, file);
+}
+
+//read <path>: map a model bank written by write. Nothing is parsed or copied; recall reads the model it is asked
+//for straight out of the mapping, so opening a bank takes the same time whatever its size.
+void qrm_read(t_qrm *x, t_symbol *path)
+{
+    t_qrm_bank b;
+    const t_qrm_bank_header *h;
+    char file[MAX_PATH_CHARS];
+    
+    if(!path || !path->s_name[0]){
+        object_error((t_object*)x, "read needs a file path");
+        return;
+    }
+    if(!qrm_bank_path(path, 0, file)){
+        object_error((t_object*)x, "read: could not find %s", path->s_name);
+        return;
+    }
+    memset(&b, 0, sizeof(b));
+#ifdef WIN_VERSION
+    LARGE_INTEGER len;
+    b.file = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(b.file == INVALID_HANDLE_VALUE || !GetFileSizeEx(b.file, &len)){
+        object_error((t_object*)x, "read: could not open %s", file);
+        if(b.file != INVALID_HANDLE_VALUE) CloseHandle(b.file);
+        return;
+    }
+    b.size = (size_t)len.QuadPart;
+    b.map = b.size ? CreateFileMappingA(b.file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    b.base = b.map ? MapViewOfFile(b.map, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st)){
+        object_error((t_object*)x, "read: could not open %s", file);
+        if(fd >= 0) close(fd);
+        return;
+    }
+    b.size = (size_t)st.st_size;
+    b.base = b.size ? mmap(NULL, b.size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(b.base == MAP_FAILED) b.base = NULL;
+    close(fd);      //the mapping keeps the file open
+#endif
+    if(!b.base){
+        object_error((t_object*)x, "read: could not map %s", file);
+        qrm_bank_unmap(&b);
+        return;
+    }
+    
+    //the header has to describe a file of exactly this size, with the columns inside it
+    h = b.base;
+    if(b.size < sizeof(t_qrm_bank_header) || memcmp(h->magic, QRM_BANK_MAGIC, 4)){
+        object_error((t_object*)x, "read: %s is not a qrm~ model bank", file);
+        qrm_bank_unmap(&b);
+        return;
+    }
+    if(h->version != QRM_BANK_VERSION || h->entry_size != sizeof(t_qrm_bank_entry)){
+        object_error((t_object*)x, "read: %s is a version %u model bank, this qrm~ reads version %d", file, h->version, QRM_BANK_VERSION);
+        qrm_bank_unmap(&b);
+        return;
+    }
+    if(h->size != b.size || h->entries + sizeof(t_qrm_bank_entry) * (uint64_t)h->count > h->freqs
+       || h->partials > b.size / sizeof(float) || h->freqs + sizeof(float) * h->partials > h->amps
+       || h->amps + sizeof(float) * h->partials > h->decays || h->decays + sizeof(float) * h->partials > b.size
+       || (h->entries | h->freqs | h->amps | h->decays) % 8){
+        object_error((t_object*)x, "read: %s is damaged", file);
+        qrm_bank_unmap(&b);
+        return;
+    }
+    b.hdr = h;
+    b.e = (const t_qrm_bank_entry *)((const char *)b.base + h->entries);
+    b.freqs = (const float *)((const char *)b.base + h->freqs);
+    b.amps = (const float *)((const char *)b.base + h->amps);
+    b.decays = (const float *)((const char *)b.base + h->decays);
+    
+    qrm_bank_unmap(&x->bank);
+    x->bank = b;
+    x->bank_count = h->count;
+}
+
+//recall <n>: model n of the bank read last, out the list outlets as if its region had just been analyzed, with n
+//on the id outlet. It becomes the last model, so bang repeats it.
+void qrm_recall(t_qrm *x, long n)
+{
+    const t_qrm_bank_entry *e;
+    long num;
+    
+    if(!x->bank.hdr){
+        object_error((t_object*)x, "recall: no model bank (read one first)");
+        return;
+    }
+    if(n < 0 || n >= x->bank_count){
+        object_error((t_object*)x, "recall: the bank holds models 0 to %ld", x->bank_count - 1);
+        return;
+    }
+    e = x->bank.e + n;
+    if(e->first > x->bank.hdr->partials || e->num > x->bank.hdr->partials - e->first){
+        object_error((t_object*)x, "recall: model %ld is damaged", n);
+        return;
+    }
+    //the model buffer holds fft_size/2 partials, so a model from a bank written at a larger fft size may not fit
+    num = MIN((long)e->num, x->fft_size / 2);
+    if(num < (long)e->num)
+        object_warn((t_object*)x, "recall: model %ld has %u partials, only the first %ld fit at fft size %ld", n, e->num, num, x->fft_size);
+    for(long k=0;k<num;k++){
+        x->model[3*k] = x->bank.freqs[e->first + k];
+        x->model[3*k+1] = x->bank.amps[e->first + k];
+        x->model[3*k+2] = x->bank.decays[e->first + k];
+    }
+    x->num_model = num;
+    x->region_max_ind = (long)e->attack;
+    x->max_val = e->peak;
+    memset(&x->last_req, 0, sizeof(t_qrm_request));
+    x->last_req.kind = QRM_REQ_LIST;
+    x->last_req.id = n;
+    x->last_req.c1 = (long)e->start;
+    x->last_req.c2 = (long)e->end;
+    
+    outlet_int(x->id_out, n);
+    outlet_int(x->out, x->region_max_ind);
+    qrm_result_out(x, x->model, x->num_model, 3, x->model_out);
+}
+
+//resolve a write or read name the way Max does: a bare file name is read from the search path and written to the
+//default folder, anything else is taken as a Max or system path. The absolute system path goes to out, which holds
+//MAX_PATH_CHARS. Returns 0 if the file can't be found to read, or its folder to write.
+int qrm_bank_path(t_symbol *name, int write, char *out)
+{
+    char file[MAX_PATH_CHARS];
+    short vol = 0;
+    t_fourcc type;
+    
+    strncpy(file, name->s_name, MAX_PATH_CHARS - 1);
+    file[MAX_PATH_CHARS - 1] = '\0';
+    if(!write){
+        if(locatefile_extended(file, &vol, &type, NULL, 0))
+            return 0;
+    } else if(!strpbrk(file, "/\\:")){
+        vol = path_getdefault();
+    } else if(path_frompathname(name->s_name, &vol, file)){
+        return 0;
+    }
+    return !path_toabsolutesystempath(vol, file, out);
+}
+
+void qrm_bank_unmap(t_qrm_bank *b)
+{
+#ifdef WIN_VERSION
+    if(b->base) UnmapViewOfFile(b->base);
+    if(b->map) CloseHandle(b->map);
+    if(b->file && b->file != INVALID_HANDLE_VALUE) CloseHandle(b->file);
+#else
+    if(b->base) munmap(b->base, b->size);
+#endif
+    memset(b, 0, sizeof(t_qrm_bank));
+}
+
+//FNV-1a over the sample bits of one channel, enough to tell whether a block changed
+unsigned long long qrm_block_hash(const t_float *tab, long start, long n, long nc, long chan)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    unsigned int bits;
+    
+    for(long i=0;i<n;i++){
+        memcpy(&bits, tab + (start+i)*nc + chan, sizeof(bits));
+        h = (h ^ bits) * 1099511628211ULL;
+    }
+    return h;
+}
+
+//fill in r->key from the current settings
+void qrm_cache_key(t_qrm *x, t_qrm_request *r)
+{
+    t_qrm_cache_key *k = &r->key;
+    
+    memset(k, 0, sizeof(t_qrm_cache_key));
+    k->buffer = x->buffer_name;
+    k->chan = x->l_chan;
+    k->kind = r->kind;
+    k->c1 = r->c1;
+    k->c2 = r->c2;
+    k->fft_size = x->fft_size;
+    k->win_len = x->win_len;
+    k->thresh = x->thresh;
+    k->num_slices = x->num_slices;
+    k->slice_spacing = x->slice_spacing;
+    k->decay_eval = x->decay_eval;
+    k->precision = x->precision;
+    k->num_bands = x->num_bands;
+    memcpy(k->band_cuts, x->band_cuts, sizeof(double) * (x->num_bands-1));
+    k->max_partials = x->max_partials;
+    k->partial_tol = x->partial_tol;
+}
+
+unsigned long long qrm_cache_hash(const t_qrm_cache_key *k)
+{
+    const unsigned char *p = (const unsigned char *)k;
+    unsigned long long h = 14695981039346656037ULL;
+    
+    for(size_t i=0;i<sizeof(t_qrm_cache_key);i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+//answer w->req from the cache if an earlier request with the same key is still in it
+int qrm_cache_serve(t_qrm *x, t_qrm_work *w)
+{
+    t_qrm_request *r = &w->req;
+    t_qrm_cache_entry *e;
+    unsigned long long h;
+    
+    if(!x->cache_size || !r->key.buffer || r->kind == QRM_REQ_LIVE)
+        return 0;
+    h = qrm_cache_hash(&r->key);
+    systhread_mutex_lock(x->cache_mutex);
+    for(e = x->cache_buckets[h % QRM_CACHE_BUCKETS]; e; e = e->chain){
+        if(e->hash == h && !memcmp(&e->key, &r->key, sizeof(t_qrm_cache_key)))
+            break;
+    }
+    if(!e){
+        systhread_mutex_unlock(x->cache_mutex);
+        return 0;
+    }
+    x->cache_hits++;
+    
+    //most recently used goes to the front
+    if(e != x->cache_head){
+        e->prev->next = e->next;
+        if(e->next) e->next->prev = e->prev;
+        else x->cache_tail = e->prev;
+        e->prev = NULL;
+        e->next = x->cache_head;
+        x->cache_head->prev = e;
+        x->cache_head = e;
+    }
+    
+    if(r->kind == QRM_REQ_LIST){
+        memcpy(w->model, e->data, sizeof(double) * e->num * 3);
+        w->attack = e->attack;
+        w->max_val = e->max_val;
+    } else {
+        memcpy(w->cooked, e->data, sizeof(double) * e->num * 2);
+    }
+    w->num_peaks = (int)e->num;
+    systhread_mutex_unlock(x->cache_mutex);
+    return 1;
+}
+
+//a prefetched frame matching w->req's settings within prefetch_tol samples of its cursor, nearest first, as the
+//answer to it. The worker may be adding frames, so the ring is read under queue_mutex.
+int qrm_prefetch_serve(t_qrm *x, t_qrm_work *w)
+{
+    t_qrm_request *r = &w->req;
+    t_qrm_cache_key k;
+    long best = -1, d = 0;
+    
+    if(!x->prefetch || !r->key.buffer || r->kind != QRM_REQ_INT)
+        return 0;
+    systhread_mutex_lock(x->queue_mutex);
+    for(long i=0;i<QRM_PREFETCH_SLOTS;i++){
+        t_qrm_prefetch *p = &x->pf[i];
+        if(!p->data) continue;
+        k = r->key;
+        k.c1 = k.c2 = p->key.c1;
+        if(memcmp(&k, &p->key, sizeof(t_qrm_cache_key))) continue;
+        if(ABS(p->key.c1 - r->c1) <= x->prefetch_tol && (best < 0 || ABS(p->key.c1 - r->c1) < d)){
+            best = i;
+            d = ABS(p->key.c1 - r->c1);
+        }
+    }
+    if(best >= 0){
+        memcpy(w->cooked, x->pf[best].data, sizeof(double) * x->pf[best].num * 2);
+        w->num_peaks = (int)x->pf[best].num;
+        x->prefetch_hits++;
+    }
+    systhread_mutex_unlock(x->queue_mutex);
+    return best >= 0;
+}
+
+//after an int request at n: queue prefetch depth cursors ahead along the scrub direction and half as many behind,
+//nearest first, replacing whatever was left of the last plan. Prefetching only happens while no request is
+//waiting: on the worker thread when async is on, otherwise a cursor at a time from a low priority qelem.
+void qrm_prefetch_plan(t_qrm *x, long n)
+{
+    long stride = x->prefetch_stride > 0 ? x->prefetch_stride : MAX(1, x->fft_size / 4);
+    long dir = n >= x->pf_last ? 1 : -1;
+    long depth = MIN(x->prefetch, QRM_PREFETCH_DEPTH);
+    
+    x->pf_last = n;
+    if(!depth) return;
+    systhread_mutex_lock(x->queue_mutex);
+    x->pf_gen++;
+    x->pf_todo = 0;
+    x->pf_next = 0;
+    for(long i=1;i<=depth;i++) x->pf_pos[x->pf_todo++] = n + dir * stride * i;
+    for(long i=1;i<=depth/2;i++){
+        if(n - dir * stride * i >= 0) x->pf_pos[x->pf_todo++] = n - dir * stride * i;
+    }
+    if(x->async) systhread_cond_signal(x->queue_cond);
+    systhread_mutex_unlock(x->queue_mutex);
+    if(!x->async) qelem_set(x->pf_qelem);
+}
+
+//analyze the next planned cursor into pf_work and keep the frame in the ring. These analyses are not counted in
+//stats, and they give up between stages as soon as a request is queued or a newer plan replaces theirs.
+//Returns 0 once the plan is done.
+int qrm_prefetch_step(t_qrm *x)
+{
+    t_qrm_request r;
+    t_qrm_work *w = &x->pf_work;
+    
+    systhread_mutex_lock(x->queue_mutex);
+    if(x->pf_next >= x->pf_todo){
+        systhread_mutex_unlock(x->queue_mutex);
+        return 0;
+    }
+    memset(&r, 0, sizeof(t_qrm_request));
+    r.kind = QRM_REQ_INT;
+    r.c1 = r.c2 = x->pf_pos[x->pf_next++];
+    r.seq = x->pf_gen;
+    systhread_mutex_unlock(x->queue_mutex);
+    
+    //lock order is always analysis_mutex, then queue_mutex; the ring itself belongs to queue_mutex
+    systhread_mutex_lock(x->analysis_mutex);
+    qrm_cache_key(x, &r);
+    systhread_mutex_lock(x->queue_mutex);
+    for(long i=0;i<QRM_PREFETCH_SLOTS;i++){
+        if(x->pf[i].data && !memcmp(&x->pf[i].key, &r.key, sizeof(t_qrm_cache_key))){
+            systhread_mutex_unlock(x->queue_mutex);
+            systhread_mutex_unlock(x->analysis_mutex);
+            return 1;
+        }
+    }
+    systhread_mutex_unlock(x->queue_mutex);
+    if(x->pf_layout != x->layout_gen){
+        qrm_work_alloc(x, w);
+        x->pf_layout = x->layout_gen;
+    }
+    w->req = r;
+    if(qrm_analyze_int(x, w)){
+        systhread_mutex_lock(x->queue_mutex);
+        //a newer plan, or a clear, has come in since the last stage check: the frame may be for another buffer
+        if(r.seq != x->pf_gen){
+            systhread_mutex_unlock(x->queue_mutex);
+            systhread_mutex_unlock(x->analysis_mutex);
+            return 1;
+        }
+        t_qrm_prefetch *p = &x->pf[x->pf_head];
+        if(p->alloc < w->num_peaks * 2){
+            if(p->data !=NULL) free(p->data);
+            p->alloc = MAX(1, w->num_peaks * 2);
+            p->data = malloc(sizeof(double) * p->alloc);
+        }
+        memcpy(p->data, w->cooked, sizeof(double) * w->num_peaks * 2);
+        p->num = w->num_peaks;
+        p->key = r.key;
+        x->pf_head = (x->pf_head + 1) % QRM_PREFETCH_SLOTS;
+        systhread_mutex_unlock(x->queue_mutex);
+    }
+    systhread_mutex_unlock(x->analysis_mutex);
+    return 1;
+}
+
+//synchronous mode: one cursor per run, so the main thread gets back to real requests in between
+void qrm_prefetch_idle(t_qrm *x)
+{
+    if(qrm_prefetch_step(x)) qelem_set(x->pf_qelem);
+}
+
+//forget every prefetched frame and what is left of the plan, e.g. when the buffer~ changes
+void qrm_prefetch_clear(t_qrm *x)
+{
+    systhread_mutex_lock(x->queue_mutex);
+    for(long i=0;i<QRM_PREFETCH_SLOTS;i++){
+        if(x->pf[i].data !=NULL) free(x->pf[i].data);
+        memset(&x->pf[i], 0, sizeof(t_qrm_prefetch));
+    }
+    x->pf_todo = 0;
+    x->pf_next = 0;
+    x->pf_gen++;
+    systhread_mutex_unlock(x->queue_mutex);
+}
+
+//keep a copy of a finished int or list result, evicting the least recently used ones to stay under cache_size
+void qrm_cache_insert(t_qrm *x, t_qrm_work *w)
+{
+    t_qrm_cache_entry *e;
+    long width = w->req.kind == QRM_REQ_LIST ? 3 : 2;
+    long bytes = sizeof(t_qrm_cache_entry) + sizeof(double) * w->num_peaks * width;
+    
+    if(!x->cache_size || !w->req.key.buffer || w->req.kind == QRM_REQ_LIVE || bytes > x->cache_size * 1024)
+        return;
+    systhread_mutex_lock(x->cache_mutex);
+    qrm_cache_trim(x, x->cache_size * 1024 - bytes);
+    
+    e = malloc(sizeof(t_qrm_cache_entry));
+    e->key = w->req.key;
+    e->hash = qrm_cache_hash(&e->key);
+    e->num = w->num_peaks;
+    e->data = malloc(sizeof(double) * MAX(1, e->num * width));
+    memcpy(e->data, width == 3 ? w->model : w->cooked, sizeof(double) * e->num * width);
+    e->attack = w->attack;
+    e->max_val = w->max_val;
+    e->bytes = bytes;
+    e->chain = x->cache_buckets[e->hash % QRM_CACHE_BUCKETS];
+    x->cache_buckets[e->hash % QRM_CACHE_BUCKETS] = e;
+    e->prev = NULL;
+    e->next = x->cache_head;
+    if(x->cache_head) x->cache_head->prev = e;
+    else x->cache_tail = e;
+    x->cache_head = e;
+    x->cache_bytes += bytes;
+    systhread_mutex_unlock(x->cache_mutex);
+}
+
+//take e out of its bucket and the LRU list and free it
+void qrm_cache_unlink(t_qrm *x, t_qrm_cache_entry *e)
+{
+    t_qrm_cache_entry **pp;
+    
+    for(pp = &x->cache_buckets[e->hash % QRM_CACHE_BUCKETS]; *pp; pp = &(*pp)->chain){
+        if(*pp == e){
+            *pp = e->chain;
+            break;
+        }
+    }
+    if(e->prev) e->prev->next = e->next;
+    else x->cache_head = e->next;
+    if(e->next) e->next->prev = e->prev;
+    else x->cache_tail = e->prev;
+    x->cache_bytes -= e->bytes;
+    free(e->data);
+    free(e);
+}
+
+//evict least recently used entries until the cache holds no more than bytes. Called with cache_mutex held.
+void qrm_cache_trim(t_qrm *x, long bytes)
+{
+    while(x->cache_tail && x->cache_bytes > bytes)
+        qrm_cache_unlink(x, x->cache_tail);
+}
+
+void qrm_cache_clear(t_qrm *x)
+{
+    systhread_mutex_lock(x->cache_mutex);
+    qrm_cache_trim(x, 0);
+    systhread_mutex_unlock(x->cache_mutex);
+}
+
+//shrinking the cache evicts right away; the hit and miss counts start over, so they describe the new size
+t_max_err qrm_attr_set_cache_size(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    systhread_mutex_lock(x->cache_mutex);
+    x->cache_size = MAX(0, atom_getlong(argv));
+    qrm_cache_trim(x, x->cache_size * 1024);
+    systhread_mutex_unlock(x->cache_mutex);
+    x->cache_hits = 0;
+    x->cache_misses = 0;
+    return 0;
+}
+
+//build the envelope pyramid for one channel of the buffer: level 0 holds the peak of every QRM_ENV_BLOCK samples,
+//each level above the peak of QRM_ENV_FANOUT blocks of the one below. Only whole blocks are kept.
+//Called with env_mutex held.
+void qrm_env_build(t_qrm *x, const t_float *tab, long frames, long nc, long chan)
+{
+    long n = frames / QRM_ENV_BLOCK;
+    
+    qrm_env_free(x);
+    x->env[0] = malloc(sizeof(float) * MAX(1, n));
+    x->env_count[0] = n;
+    for(long b=0;b<n;b++)
+        x->env[0][b] = qrm_abs_max(tab + b*QRM_ENV_BLOCK*nc + chan, QRM_ENV_BLOCK, nc);
+    x->env_levels = 1;
+    while(x->env_levels < QRM_ENV_LEVELS && x->env_count[x->env_levels-1] >= QRM_ENV_FANOUT){
+        long L = x->env_levels;
+        const float *below = x->env[L-1];
+        n = x->env_count[L-1] / QRM_ENV_FANOUT;
+        x->env[L] = malloc(sizeof(float) * n);
+        x->env_count[L] = n;
+        for(long b=0;b<n;b++){
+            float m = 0;
+            for(long k=0;k<QRM_ENV_FANOUT;k++) m = MAX(m, below[b*QRM_ENV_FANOUT + k]);
+            x->env[L][b] = m;
+        }
+        x->env_levels++;
+    }
+    x->env_frames = frames;
+    x->env_nc = nc;
+    x->env_chan = chan;
+    x->env_dirty = 0;
+}
+
+void qrm_env_free(t_qrm *x)
+{
+    for(long L=0;L<x->env_levels;L++){
+        free(x->env[L]);
+        x->env[L] = NULL;
+    }
+    x->env_levels = 0;
+}
+
+//highest pyramid level with a block starting exactly at p and ending by c2 (its length in *bs), or -1
+long qrm_env_level(t_qrm *x, long p, long c2, long *bs)
+{
+    long L = -1, s = QRM_ENV_BLOCK;
+    
+    while(L+1 < x->env_levels && p % s == 0 && p + s <= c2 && p / s < x->env_count[L+1]){
+        *bs = s;
+        L++;
+        s *= QRM_ENV_FANOUT;
+    }
+    return L;
+}
+
+//largest |sample| in c1..c2: the biggest blocks that fit, samples only at the unaligned edges
+float qrm_env_max(t_qrm *x, const t_float *tab, long nc, long chan, long c1, long c2)
+{
+    float m = 0;
+    long p = c1, L, bs, next;
+    
+    while(p < c2){
+        L = qrm_env_level(x, p, c2, &bs);
+        if(L >= 0){
+            m = MAX(m, x->env[L][p / bs]);
+            p += bs;
+        } else {
+            next = MIN(c2, (p / QRM_ENV_BLOCK + 1) * QRM_ENV_BLOCK);
+            m = MAX(m, qrm_abs_max(tab + p*nc + chan, next - p, nc));
+            p = next;
+        }
+    }
+    return m;
+}
+
+//first position in c1..c2 holding |sample| == m. Blocks quieter than m are skipped whole; a block that is not
+//is refined through the levels below it, down to the samples of the one level 0 block that holds m.
+long qrm_env_find(t_qrm *x, const t_float *tab, long nc, long chan, long c1, long c2, float m)
+{
+    long p = c1, L, bs, next;
+    
+    while(p < c2){
+        L = qrm_env_level(x, p, c2, &bs);
+        if(L > 0 && x->env[L][p / bs] < m){
+            p += bs;
+            continue;
+        }
+        next = MIN(c2, (p / QRM_ENV_BLOCK + 1) * QRM_ENV_BLOCK);
+        if(L < 0 || x->env[0][p / QRM_ENV_BLOCK] >= m){
+            for(;p<next;p++){
+                if(ABS(tab[p*nc+chan]) == m) return p;
+            }
+        }
+        p = next;
+    }
+    return c1;
+}
+
+//microseconds on a monotonic clock
+double qrm_now(void)
+{
+#ifdef WIN_VERSION
+    LARGE_INTEGER f, t;
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    return (double)t.QuadPart * 1e6 / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+#endif
+}
+
+//lap timer: charge the time since *t to stage, and start the next lap from now
+void qrm_lap(t_qrm_work *w, long stage, double *t)
+{
+    double now = qrm_now();
+    
+    w->stage_us[stage] += now - *t;
+    w->stages |= 1u << stage;
+    *t = now;
+}
+
+void qrm_series_push(t_qrm_series *s, double v)
+{
+    s->v[s->count % QRM_STATS_WINDOW] = (float)v;
+    s->count++;
+}
+
+static int qrm_float_cmp(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+//count, then min, mean and 99th percentile of the values still in the window, into a[0..3]
+void qrm_series_summary(t_qrm_series *s, t_atom *a)
+{
+    float v[QRM_STATS_WINDOW];
+    long n = MIN(s->count, QRM_STATS_WINDOW);
+    double sum = 0;
+    
+    memcpy(v, s->v, sizeof(float) * n);
+    qsort(v, n, sizeof(float), qrm_float_cmp);
+    for(long i=0;i<n;i++) sum += v[i];
+    atom_setlong(a, s->count);
+    atom_setfloat(a + 1, n ? v[0] : 0);
+    atom_setfloat(a + 2, n ? sum / n : 0);
+    atom_setfloat(a + 3, n ? v[(99 * n + 99) / 100 - 1] : 0);
+}
+
+//fold one finished analysis into the object's stats
+void qrm_stats_record(t_qrm *x, t_qrm_work *w)
+{
+    systhread_mutex_lock(x->stats_mutex);
+    for(long i=0;i<QRM_STAGES;i++){
+        if(w->stages & (1u << i)) qrm_series_push(&x->stats[i], w->stage_us[i]);
+    }
+    qrm_series_push(&x->stat_peaks, w->num_peaks);
+    x->stat_nans += w->nans;
+    systhread_mutex_unlock(x->stats_mutex);
+}
+
+//"stats" sends one message per stage that has run, <stage> count min mean p99 in microseconds, then
+//peaks count min mean p99 and nans <count>, out the info outlet. "stats reset" starts over.
+void qrm_stats(t_qrm *x, t_symbol *s)
+{
+    t_atom a[QRM_STAGES + 1][4];
+    long nans;
+    
+    systhread_mutex_lock(x->stats_mutex);
+    if(s == gensym("reset")){
+        memset(x->stats, 0, sizeof(x->stats));
+        memset(&x->stat_peaks, 0, sizeof(t_qrm_series));
+        x->stat_nans = 0;
+        systhread_mutex_unlock(x->stats_mutex);
+        return;
+    }
+    for(long i=0;i<QRM_STAGES;i++) qrm_series_summary(&x->stats[i], a[i]);
+    qrm_series_summary(&x->stat_peaks, a[QRM_STAGES]);
+    nans = x->stat_nans;
+    systhread_mutex_unlock(x->stats_mutex);
+    
+    for(long i=0;i<QRM_STAGES;i++){
+        if(atom_getlong(a[i])) outlet_anything(x->info_out, gensym(qrm_stage_names[i]), 4, a[i]);
+    }
+    outlet_anything(x->info_out, gensym("peaks"), 4, a[QRM_STAGES]);
+    atom_setlong(a[0], nans);
+    outlet_anything(x->info_out, gensym("nans"), 1, a[0]);
+}
+
+//list request over several channels of the buffer~. They share one attack, the loudest sample of any of them,
+//and one set of analysis points; each slice's frames are deinterleaved for every channel in a single sweep.
+//Every channel's model goes into w->ch_models, and their merge into w->model.
+int qrm_analyze_channels(t_qrm *x, t_qrm_work *w)
+{
+    double t = qrm_now();
+    long frames, nc, chan;
+    long ns = x->num_slices, n = x->fft_size, npeaks = x->fft_size/2;
+    t_float *tab = qrm_samples_lock(x, w, &frames, &nc, &chan);
+    
+    if(!tab){
+        object_error((t_object*)x,"Did not get buffer.");
+        return 0;
+    }
+    w->nch = qrm_channel_list(x, nc, w->ch);
+    size_t bytes = (sizeof(float) * w->nch * ns * n + 63) & ~(size_t)63;
+    bytes += sizeof(double) * w->nch * npeaks * 3 * 2;
+    if(w->multi_alloc < bytes){
+        if(w->multi !=NULL) fftw_free(w->multi);
+        w->multi = fftw_malloc(bytes);
+        w->multi_alloc = w->multi ? bytes : 0;
+    }
+    if(!w->multi){
+        qrm_samples_unlock(x, w);
+        object_error((t_object*)x, "out of memory for %ld channels", w->nch);
+        return 0;
+    }
+    w->deint = (float *)w->multi;
+    w->ch_models = (double *)(w->multi + ((sizeof(float) * w->nch * ns * n + 63) & ~(size_t)63));
+    w->merge = w->ch_models + w->nch * npeaks * 3;
+    
+    //attack: one sweep over the region's frames, first occurrence of the loudest sample
+    w->attack = w->req.c1;
+    w->max_val = 0;
+    for(long j=w->req.c1;j<w->req.c2;j++){
+        const t_float *f = tab + j*nc;
+        for(long c=0;c<w->nch;c++){
+            if(ABS(f[w->ch[c]]) > w->max_val){
+                w->max_val = ABS(f[w->ch[c]]);
+                w->attack = j;
+            }
+        }
+    }
+    qrm_lap(w, QRM_STAGE_ATTACK, &t);
+    qrm_slice_positions(x, w);
+    
+    //deinterleave: read each slice's frames once, front to back, writing one stream per channel
+    for(long j=0;j<ns;j++){
+        const t_float *f = tab + w->slices[j].index_in_buffer * nc;
+        for(long k=0;k<x->win_len;k++){
+            for(long c=0;c<w->nch;c++)
+                w->deint[(c*ns + j)*n + k] = f[k*nc + w->ch[c]];
+        }
+    }
+    qrm_samples_unlock(x, w);
+    qrm_lap(w, QRM_STAGE_WINDOW, &t);
+    
+    for(long c=0;c<w->nch;c++){
+        const t_float *src[QRM_MAX_SLICES];
+        for(long j=0;j<ns;j++) src[j] = w->deint + (c*ns + j)*n;
+        t = qrm_now();
+        qrm_slices_window(x, w, src, 1);
+        qrm_lap(w, QRM_STAGE_WINDOW, &t);
+        if(!qrm_model_fit(x, w)) return 0;
+        memcpy(w->ch_models + c*npeaks*3, w->model, sizeof(double) * w->num_peaks * 3);
+        w->ch_num[c] = w->num_peaks;
+    }
+    t = qrm_now();
+    w->num_peaks = qrm_models_merge(w->ch_models, w->ch_num, w->nch, npeaks * 3, w->sr / n, w->merge, w->model, npeaks);
+    w->num_peaks = qrm_partials_limit(x, w, w->model, w->num_peaks, 3);
+    qrm_lap(w, QRM_STAGE_REFINE, &t);
+    return 1;
+}
+
+//0-based channels of an nc channel buffer~ that a channels request covers; ones the buffer~ does not have are skipped
+long qrm_channel_list(t_qrm *x, long nc, long *ch)
+{
+    long n = 0;
+    
+    if(x->channels_all){
+        for(long c=0;c<MIN(nc, QRM_MAX_CHANNELS);c++) ch[n++] = c;
+        return n;
+    }
+    for(long i=0;i<x->num_channels;i++){
+        if(x->channels[i] >= 1 && x->channels[i] <= nc) ch[n++] = x->channels[i] - 1;
+    }
+    return n;
+}
+
+static int qrm_triple_cmp(const void *a, const void *b)
+{
+    double fa = *(const double *)a, fb = *(const double *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+//merge nch models (num[c] triples each, stride doubles apart) into at most max triples in out. Partials of
+//different channels less than tol Hz apart are one partial: amplitude is their sum over nch, frequency and decay
+//are amplitude-weighted means. scratch holds every triple of every channel.
+long qrm_models_merge(const double *models, const long *num, long nch, long stride, double tol, double *scratch, double *out, long max)
+{
+    long total = 0, m = 0;
+    
+    for(long c=0;c<nch;c++){
+        memcpy(scratch + total*3, models + c*stride, sizeof(double) * num[c] * 3);
+        total += num[c];
+    }
+    qsort(scratch, total, sizeof(double) * 3, qrm_triple_cmp);
+    for(long i=0;i<total && m<max;){
+        double sa = 0, sf = 0, sd = 0, f0 = scratch[i*3];
+        long j = i;
+        for(;j<total && scratch[j*3] - f0 < tol;j++){
+            double a = scratch[j*3+1];
+            sa += a;
+            sf += a * scratch[j*3];
+            sd += a * scratch[j*3+2];
+        }
+        out[m*3] = sa > 0 ? sf / sa : f0;
+        out[m*3+1] = sa / nch;
+        out[m*3+2] = sa > 0 ? sd / sa : scratch[i*3+2];
+        m++;
+        i = j;
+    }
+    return m;
+}
+
+//a channels result: "channel <n> f a d ..." for each channel, then the merged model as a list if merge is on
+void qrm_channels_out(t_qrm *x)
+{
+    long npeaks = x->fft_size/2;
+    
+    for(long c=0;c<x->num_ch;c++){
+        const double *m = x->ch_models + c*npeaks*3;
+        long l = MIN(x->ch_num[c] * 3, (x->num_atoms - 1) / 3 * 3);
+        atom_setlong(x->atoms, x->ch_list[c] + 1);
+        for(long i=0;i<l;i++) atom_setfloat(x->atoms + 1 + i, m[i]);
+        outlet_anything(x->model_out, gensym("channel"), (short)(l + 1), x->atoms);
+    }
+    if(x->merge)
+        qrm_result_out(x, x->model, x->num_model, 3, x->model_out);
+}
+
+//channels 1 2 ..., channels all, or channels with nothing after it to go back to l_chan alone.
+//changes wait for any analysis in progress, which reads the list.
+t_max_err qrm_attr_set_channels(t_qrm *x, t_object *attr, long *argc, t_atom *argv)
+{
+    long n = (argc && argv) ? *argc : 0;
+    
+    systhread_mutex_lock(x->analysis_mutex);
+    x->channels_all = n && atom_gettype(argv) == A_SYM && atom_getsym(argv) == gensym("all");
+    x->num_channels = 0;
+    for(long i=0;!x->channels_all && i<MIN(n, QRM_MAX_CHANNELS);i++){
+        long c = atom_getlong(argv + i);
+        if(c >= 1) x->channels[x->num_channels++] = c;
+    }
+    systhread_mutex_unlock(x->analysis_mutex);
+    return 0;
+}
+
+t_max_err qrm_attr_get_channels(t_qrm *x, t_object *attr, long *argc, t_atom **argv)
+{
+    char alloc;
+    
+    if(x->channels_all){
+        atom_alloc(argc, argv, &alloc);
+        atom_setsym(*argv, gensym("all"));
+        return 0;
+    }
+    atom_alloc_array(MAX(1, x->num_channels), argc, argv, &alloc);
+    *argc = x->num_channels;
+    for(long i=0;i<x->num_channels;i++) atom_setlong(*argv + i, x->channels[i]);
+    return 0;
+}